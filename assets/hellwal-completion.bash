@@ -8,7 +8,7 @@ _hellwal_complete() {
     
     opts="-i --image -d --dark -l --light -c --color -v --invert -m --neon-mode -r --random -q --quiet -j --json \
           -s --script -f --template-folder -o --output -t --theme -k --theme-folder -g --gray-scale -n --dark-offset \
-          -b --bright-offset --debug --no-cache --static-background --static-foreground -h --help"
+          -b --bright-offset -p --palette-size -B --bins -w --weighting --stream --pyramid --progressive --no-warm-start --histogram-cache --cache-text --cache-max-size --cache-max-entries --cache-gc --prewarm --recursive --jobs --durable --generations --rollback --debug --no-cache --static-background --static-foreground -h --help"
 
     case "$prev" in
         -i|--image)
@@ -19,7 +19,7 @@ _hellwal_complete() {
             COMPREPLY=( $(compgen -f -- "$cur") ) # Complete script files
             return 0
             ;;
-        -f|--template-folder|-o|--output|-k|--theme-folder)
+        -f|--template-folder|-o|--output|-k|--theme-folder|--prewarm)
             COMPREPLY=( $(compgen -d -- "$cur") ) # Complete directories
             return 0
             ;;
@@ -31,6 +31,18 @@ _hellwal_complete() {
             COMPREPLY=( $(compgen -W "0.0 0.1 0.2 0.3 0.4 0.5 0.6 0.7 0.8 0.9 1.0" -- "$cur") ) # Suggest valid floats
             return 0
             ;;
+        -B|--bins)
+            COMPREPLY=( $(compgen -W "4 8 16 32" -- "$cur") )
+            return 0
+            ;;
+        -w|--weighting)
+            COMPREPLY=( $(compgen -W "none center edge saliency" -- "$cur") )
+            return 0
+            ;;
+        -p|--palette-size)
+            COMPREPLY=( $(compgen -W "16 256" -- "$cur") )
+            return 0
+            ;;
         --static-background|--static-foreground)
             COMPREPLY=( $(compgen -W "#000000 #FFFFFF #FF0000 #00FF00 #0000FF #FFFF00 #FF00FF #00FFFF" -- "$cur") )
             return 0
@@ -18,6 +18,24 @@ complete -c hellwal -x -s k -l theme-folder -a "(__fish_complete_directories)" -
 complete -c hellwal -x -s g -l gray-scale -a "(seq 0 .1 1)" -d "Apply grayscale filter"
 complete -c hellwal -x -s n -l dark-offset -a "(seq 0 .1 1)" -d "Adjust darkness offset"
 complete -c hellwal -x -s b -l bright-offset -a "(seq 0 .1 1)" -d "Adjust brightness offset"
+complete -c hellwal -x -s B -l bins -a "4 8 16 32" -d "Histogram bins per channel"
+complete -c hellwal -x -s w -l weighting -a "none center edge saliency" -d "Weight pixels when computing palette"
+complete -c hellwal -f -l stream -d "Quantize rows in one pass, PPM (JPEG/PNG if built with them) without whole image"
+complete -c hellwal -f -l pyramid -d "Coarse-to-fine palette, refine only ambiguous pixels"
+complete -c hellwal -f -l progressive -d "Apply quick palette first, refine it in background"
+complete -c hellwal -f -l no-warm-start -d "Do not seed colors with palettes of similar cached images"
+complete -c hellwal -f -l histogram-cache -d "Keep image histogram, re-quantize from it without decoding"
+complete -c hellwal -f -l cache-text -d "Also export cached palettes as text .hellwal files"
+complete -c hellwal -x -l cache-max-size -d "Evict least recently used palettes above size (e.g. 50M)"
+complete -c hellwal -x -l cache-max-entries -d "Evict least recently used palettes above count"
+complete -c hellwal -f -l cache-gc -d "Compact cache, drop evicted and stale entries and exit"
+complete -c hellwal -x -l prewarm -a "(__fish_complete_directories)" -d "Compute and cache palettes of all images in directory and exit"
+complete -c hellwal -f -l recursive -d "Also prewarm images in subdirectories"
+complete -c hellwal -x -l jobs -d "Parallel jobs for templates and prewarm, defaults to number of cpus"
+complete -c hellwal -f -l durable -d "Sync template outputs to disk before replacing old ones"
+complete -c hellwal -f -l generations -d "Render templates into new generation, switch 'current' link to it"
+complete -c hellwal -f -l rollback -d "Switch 'current' link back to previous generation and exit"
+complete -c hellwal -x -s p -l palette-size -a "16 256" -d "Number of palette colors (16-256)"
 complete -c hellwal -f -l check-contrast -d "Ensure colors are readable against the background"
 complete -c hellwal -f -l preview -d "Preview current terminal colorscheme"
 complete -c hellwal -f -l preview-small -d "Preview current terminal colorscheme - small factor"
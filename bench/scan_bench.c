@@ -0,0 +1,99 @@
+/*
+ * delimiter scan throughput of hell_parser
+ *
+ * usage: bench/scan_bench [size in MB]
+ *
+ * literal-heavy input with one "%%" every 4 KB, scanned
+ * character by character with hell_parser_next() and with
+ * hell_parser_skip_to(), best of several passes is reported.
+ * build with -mavx2 or -march=native to get AVX2 path
+ */
+
+#define HELL_PARSER_IMPLEMENTATION
+#include "../hell_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PASSES 10
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* delimiters found reading one character at a time */
+static size_t scan_next(const char *buf, size_t len)
+{
+    hell_parser_t p;
+    hell_parser_init(&p, buf, len);
+
+    size_t found = 0;
+    char c;
+    while (hell_parser_next(&p, &c) == HELL_PARSER_OK)
+        found += c == '%' || c == '\\';
+    return found;
+}
+
+/* delimiters found jumping from one to next */
+static size_t scan_skip(const char *buf, size_t len)
+{
+    hell_parser_t p;
+    hell_parser_init(&p, buf, len);
+
+    size_t found = 0;
+    while (hell_parser_skip_to(&p, '%', '\\'), p.pos < p.length)
+    {
+        found++;
+        p.pos++;
+    }
+    return found;
+}
+
+static void run(const char *name, size_t (*scan)(const char *, size_t), const char *buf, size_t len)
+{
+    double best = 1e9;
+    size_t found = 0;
+
+    for (int i = 0; i < PASSES; i++)
+    {
+        double start = now();
+        found = scan(buf, len);
+        double t = now() - start;
+        if (t < best)
+            best = t;
+    }
+
+    printf("%-8s %6.2f GB/s  (%zu delimiters, %.2f ms)\n", name, len / best / 1e9, found, best * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 16) << 20;
+    char *buf = malloc(size);
+    if (buf == NULL || size == 0)
+        return 1;
+
+    static const char text[] = "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n";
+    for (size_t i = 0; i < size; i++)
+        buf[i] = i % 4096 < 4094 ? text[i % (sizeof(text) - 1)] : '%';
+
+#if defined(HELL_PARSER_AVX2)
+    const char *isa = "avx2";
+#elif defined(HELL_PARSER_SSE2)
+    const char *isa = "sse2";
+#else
+    const char *isa = "scalar";
+#endif
+    printf("%zu MB, hell_memchr2: %s\n", size >> 20, isa);
+
+    run("next", scan_next, buf, size);
+    run("skip_to", scan_skip, buf, size);
+
+    free(buf);
+    return 0;
+}
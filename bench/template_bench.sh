@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# times rendering of synthetic multi-megabyte template
+#
+# usage: bench/template_bench.sh [hellwal binary] [size in MB] [runs]
+#
+# vars.txt is mostly color variables, so it measures how output is
+# built; text.txt is plain text with a variable every 4 KB, so it
+# measures how fast template is scanned for delimiters. Startup and
+# theme parsing are measured on empty template dir and subtracted.
+# Best of runs is reported.
+
+HELLWAL=${1:-./hellwal}
+SIZE_MB=${2:-4}
+RUNS=${3:-5}
+THEME=${THEME:-$(dirname "$0")/../themes/gruvbox.hellwal}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+mkdir "$TMP/vars" "$TMP/text" "$TMP/empty" "$TMP/out"
+
+# ~72 bytes per line, 3 variables in each
+LINE='color1 = %% color1.hex %%, bg = %% background.rgb %%, dim = #%% color8.hex %%'
+yes "$LINE" | head -c $((SIZE_MB * 1024 * 1024)) > "$TMP/vars/vars.txt"
+echo >> "$TMP/vars/vars.txt"
+
+# 4 KB of text, then a variable
+TEXT=$(yes 'Lorem ipsum dolor sit amet, consectetur adipiscing elit.' | head -c 4096 | tr '\n' ' ')
+yes "$TEXT %% color1.hex %%" | head -c $((SIZE_MB * 1024 * 1024)) > "$TMP/text/text.txt"
+echo >> "$TMP/text/text.txt"
+
+now_ns() { date +%s%N; }
+
+# best wall time of RUNS runs in ns, $1 is template dir
+best_run()
+{
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now_ns)
+        "$HELLWAL" -t "$THEME" -f "$1" -o "$TMP/out/" --skip-term-colors --no-cache -q > /dev/null || exit 1
+        t=$(($(now_ns) - start))
+        if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+        i=$((i + 1))
+    done
+    echo $best
+}
+
+base=$(best_run "$TMP/empty")
+echo "startup: $((base / 1000)) us"
+
+for name in vars text; do
+    full=$(best_run "$TMP/$name")
+    bytes=$(wc -c < "$TMP/$name/$name.txt")
+    vars=$(grep -o '%%' "$TMP/$name/$name.txt" | wc -l)
+
+    render=$((full - base))
+    [ $render -gt 0 ] || render=1
+
+    echo "$name.txt: $bytes bytes, $((vars / 2)) variables," \
+         "$((render / 1000)) us, $(awk "BEGIN { printf \"%.1f\", $bytes * 1000 / $render }") MB/s"
+done
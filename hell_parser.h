@@ -82,6 +82,16 @@ extern "C" {
 #include <stddef.h>
 #include <string.h>
 
+/* Vectorized scanning, scalar code is used without them */
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define HELL_PARSER_AVX2
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HELL_PARSER_SSE2
+#endif
+
 /* Define your own malloc etc. */
 #if defined(HELL_MALLOC) && defined(HELL_FREE) && (defined(HELL_REALLOC) || defined(HELL_REALLOC_SIZED))
 // ok
@@ -115,17 +125,40 @@ typedef struct
     size_t length;       /* Length of the input string */
 } hell_parser_t;
 
+/* View into the input, it is not null terminated */
+typedef struct
+{
+    const char *ptr;
+    size_t len;
+} hell_span_t;
+
 /* Function Declarations */
 HELL_DEF void hell_parser_destroy(hell_parser_t *parser);
 HELL_DEF int hell_parser_eof(const hell_parser_t *parser);
 HELL_DEF hell_parser_t *hell_parser_create(const char *input);
+HELL_DEF void hell_parser_init(hell_parser_t *parser, const char *input, size_t length);
 HELL_DEF hell_parser_status_t hell_parser_next(hell_parser_t *parser, char *out);
 HELL_DEF hell_parser_status_t hell_parser_delim(hell_parser_t *parser, char delim, unsigned count);
 HELL_DEF hell_parser_status_t hell_parser_delim_buffer_between(hell_parser_t *parser, char delim, unsigned count, char **buffer);
+HELL_DEF hell_parser_status_t hell_parser_delim_span_between(hell_parser_t *parser, char delim, unsigned count, hell_span_t *span);
+HELL_DEF int hell_span_split(hell_span_t span, char delim, hell_span_t *left, hell_span_t *right);
+HELL_DEF int hell_span_eq(hell_span_t span, const char *str);
+HELL_DEF const char *hell_memchr2(const char *s, size_t n, char a, char b);
+HELL_DEF size_t hell_parser_skip_to(hell_parser_t *parser, char a, char b);
 
 /* Implementation */
 #ifdef HELL_PARSER_IMPLEMENTATION
 
+/* Set up parser over [length] bytes of input, e.g. on the stack,
+ * it does not allocate and does not need hell_parser_destroy()
+ */
+HELL_DEF void hell_parser_init(hell_parser_t *parser, const char *input, size_t length)
+{
+    parser->input = input;
+    parser->pos = 0;
+    parser->length = length;
+}
+
 HELL_DEF hell_parser_t *hell_parser_create(const char *input)
 {
     if (!input) return NULL;
@@ -133,9 +166,7 @@ HELL_DEF hell_parser_t *hell_parser_create(const char *input)
     hell_parser_t *parser = (hell_parser_t *)malloc(sizeof(hell_parser_t));
     if (!parser) return NULL;
 
-    parser->input = input;
-    parser->pos = 0;
-    parser->length = strlen(input);
+    hell_parser_init(parser, input, strlen(input));
 
     return parser;
 }
@@ -161,6 +192,59 @@ HELL_DEF hell_parser_status_t hell_parser_next(hell_parser_t *parser, char *out)
     return HELL_PARSER_OK;
 }
 
+/* First occurrence of a or b in n bytes of s, NULL if there's none.
+ * Goes 32 (AVX2) or 16 (SSE2) bytes at a time when compiled with them.
+ */
+HELL_DEF const char *hell_memchr2(const char *s, size_t n, char a, char b)
+{
+    size_t i = 0;
+
+#ifdef HELL_PARSER_AVX2
+    const __m256i va32 = _mm256_set1_epi8(a);
+    const __m256i vb32 = _mm256_set1_epi8(b);
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va32), _mm256_cmpeq_epi8(v, vb32)));
+        if (mask)
+            return s + i + __builtin_ctz(mask);
+    }
+#endif
+
+#ifdef HELL_PARSER_SSE2
+    const __m128i va16 = _mm_set1_epi8(a);
+    const __m128i vb16 = _mm_set1_epi8(b);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va16), _mm_cmpeq_epi8(v, vb16)));
+        if (mask)
+            return s + i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < n; i++)
+        if (s[i] == a || s[i] == b)
+            return s + i;
+
+    return NULL;
+}
+
+/* Move to next a or b (or end of input) without reading characters one by one,
+ * returns how many characters were skipped
+ */
+HELL_DEF size_t hell_parser_skip_to(hell_parser_t *parser, char a, char b)
+{
+    if (!parser || parser->pos >= parser->length)
+        return 0;
+
+    size_t from = parser->pos;
+    const char *found = hell_memchr2(parser->input + from, parser->length - from, a, b);
+
+    parser->pos = found ? (size_t)(found - parser->input) : parser->length;
+    return parser->pos - from;
+}
+
 HELL_DEF hell_parser_status_t hell_parser_delim(hell_parser_t *parser, char delim, unsigned count)
 {
     if (!parser)
@@ -189,27 +273,32 @@ HELL_DEF hell_parser_status_t hell_parser_delim(hell_parser_t *parser, char deli
 
 /* Get content inside delim [count] times, if count is 0 it defaults to 1.
  * For example, for '%' with count 2, it triggers on "%%" in the text.
- * Dynamically allocates memory for the content between delimiters and stores it in `*buffer`.
- * CALLER MUST FREE THE ALLOCATED MEMORY.
+ * Stores view of the content between delimiters in `*span`, nothing is copied.
  */
-HELL_DEF hell_parser_status_t hell_parser_delim_buffer_between(hell_parser_t *parser, char delim, unsigned count, char **buffer)
+HELL_DEF hell_parser_status_t hell_parser_delim_span_between(hell_parser_t *parser, char delim, unsigned count, hell_span_t *span)
 {
-    if (!parser || !buffer)
+    if (!parser || !span)
         return HELL_PARSER_ERROR;
 
     count = (count == 0) ? 1 : count;  /* Default count to 1 if 0                      */
     size_t matched = 0;                /* Tracks consecutive delimiter matches         */
-    size_t capacity = 64;              /* Initial buffer capacity                      */
-    size_t buffer_pos = 0;             /* Tracks position in the buffer                */
+    size_t start = 0;                  /* Position right after opening delimiters      */
     int inside = 0;                    /* Flag to determine if we're inside delimiters */
 
-    *buffer = (char *)malloc(capacity);
-    if (!*buffer) {
-        return HELL_PARSER_ERROR;
-    }
-
     while (!hell_parser_eof(parser))
     {
+        /* nothing but delimiters matters, jump right to the next one */
+        if (matched == 0)
+        {
+            const char *found = (const char *)memchr(parser->input + parser->pos, delim, parser->length - parser->pos);
+            if (!found)
+            {
+                parser->pos = parser->length;
+                break;
+            }
+            parser->pos = (size_t)(found - parser->input);
+        }
+
         char current;
         if (hell_parser_next(parser, &current) != HELL_PARSER_OK)
             break;
@@ -221,54 +310,72 @@ HELL_DEF hell_parser_status_t hell_parser_delim_buffer_between(hell_parser_t *pa
             {
                 if (inside)
                 {
-                    (*buffer)[buffer_pos] = '\0';
+                    /* delimiters shorter than count are part of the content */
+                    span->ptr = parser->input + start;
+                    span->len = parser->pos - count - start;
                     return HELL_PARSER_OK;
                 }
-                else
-                {
-                    inside = 1;
-                    buffer_pos = 0;
-                    matched = 0;
-                }
+
+                inside = 1;
+                start = parser->pos;
+                matched = 0;
             }
         }
         else
-        {
-            if (inside)
-            {
-                int last_matched_unmatched = 0;
-                if (matched > 0)
-                    last_matched_unmatched = matched;
-
-                if (buffer_pos + 1 + last_matched_unmatched >= capacity)
-                {
-                    capacity *= 2;
-                    char *new_buffer = (char *)realloc(*buffer, capacity);
-                    if (!new_buffer)
-                    {
-                        free(*buffer);
-                        return HELL_PARSER_ERROR;
-                    }
-                    *buffer = new_buffer;
-                }
-                
-                while (last_matched_unmatched > 0)
-                {
-                    last_matched_unmatched--;
-                    (*buffer)[buffer_pos++] = delim;
-                }
-                (*buffer)[buffer_pos++] = current;
-                
-            }
             matched = 0;
-        }
     }
 
-    free(*buffer);
-    *buffer = NULL;
     return HELL_PARSER_ERROR;
 }
 
+/* Same as hell_parser_delim_span_between, but content is copied to `*buffer`.
+ * CALLER MUST FREE THE ALLOCATED MEMORY.
+ */
+HELL_DEF hell_parser_status_t hell_parser_delim_buffer_between(hell_parser_t *parser, char delim, unsigned count, char **buffer)
+{
+    if (!buffer)
+        return HELL_PARSER_ERROR;
+
+    *buffer = NULL;
+
+    hell_span_t span;
+    if (hell_parser_delim_span_between(parser, delim, count, &span) != HELL_PARSER_OK)
+        return HELL_PARSER_ERROR;
+
+    *buffer = (char *)malloc(span.len + 1);
+    if (!*buffer)
+        return HELL_PARSER_ERROR;
+
+    memcpy(*buffer, span.ptr, span.len);
+    (*buffer)[span.len] = '\0';
+
+    return HELL_PARSER_OK;
+}
+
+/* Split span on first delim into left and right (both without delim),
+ * returns 0 if there's no delim
+ */
+HELL_DEF int hell_span_split(hell_span_t span, char delim, hell_span_t *left, hell_span_t *right)
+{
+    const char *found = span.len ? (const char *)memchr(span.ptr, delim, span.len) : NULL;
+    if (!found)
+        return 0;
+
+    left->ptr = span.ptr;
+    left->len = (size_t)(found - span.ptr);
+    right->ptr = found + 1;
+    right->len = span.len - left->len - 1;
+
+    return 1;
+}
+
+/* Compare span with null terminated string */
+HELL_DEF int hell_span_eq(hell_span_t span, const char *str)
+{
+    size_t len = strlen(str);
+    return span.len == len && memcmp(span.ptr, str, len) == 0;
+}
+
 HELL_DEF int hell_parser_eof(const hell_parser_t *parser)
 {
     return (parser && parser->pos >= parser->length);
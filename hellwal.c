@@ -106,18 +106,36 @@
 #include <glob.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <libgen.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+/* optional row decoders for --stream, make STREAM_DECODERS=1 */
+#if defined(HELLWAL_LIBJPEG) || defined(HELLWAL_LIBPNG)
+#include <setjmp.h>
+#endif
+#ifdef HELLWAL_LIBJPEG
+#include <jpeglib.h>
+#endif
+#ifdef HELLWAL_LIBPNG
+#include <png.h>
+#endif
+
 #define HELL_PARSER_IMPLEMENTATION
 #include "hell_parser.h"
 
@@ -130,7 +148,117 @@
 
 /* just palette size */
 #define PALETTE_SIZE 16
+
+/* default histogram bins per channel, --bins picks one of HISTOGRAM_KERNELS */
 #define BINS 8
+#define BINS_MAX 32
+
+/* upper limit of --palette-size, xterm-256 extended palette */
+#define PALETTE_MAX_SIZE 256
+
+/* longest side of reduced image used to compute pixel weights */
+#define WEIGHT_MAP_SIZE 128
+
+/* bytes (16 RGB pixels) summed per block when image is reduced, fixed
+ * trip count lets compiler vectorize it even with its -O2 cost model */
+#define WEIGHT_BLOCK 48
+
+/* regions of image sampled for second half of palette */
+#define SAMPLE_REGIONS 8
+
+/* rows handed over at once by streaming decoder */
+#define STREAM_ROWS 64
+
+/*
+ * coarse-to-fine: image is reduced PYRAMID_FACTOR times per dimension,
+ * from pixels PYRAMID_STEP apart (1/4 of them), cells closer than
+ * PYRAMID_MARGIN to decision boundary or with channel spread over
+ * PYRAMID_SPREAD are refined at full resolution
+ */
+#define PYRAMID_FACTOR 4
+#define PYRAMID_STEP (PYRAMID_FACTOR / 2)
+#define PYRAMID_MARGIN 12.0f
+#define PYRAMID_SPREAD 48
+
+/*
+ * early exit: sample that occupies at most LOW_ENTROPY_CELLS cells
+ * of 4 bit per channel histogram gets palette directly from cells
+ */
+#define LOW_ENTROPY_SAMPLE 4096
+#define LOW_ENTROPY_CELLS 24
+
+/* pixels sampled for quick palette in progressive mode */
+#define PROGRESSIVE_SAMPLE 4096
+
+/* refined palette is re-applied only if any color moved further than that */
+#define PROGRESSIVE_THRESHOLD 12.0f
+
+/* squared distance from every centroid that spawns a new one */
+#define STREAM_SPAWN_DISTANCE (48 * 48)
+
+/* image signature is a tiny thumbnail stored with cached palette */
+#define SIGNATURE_GRID 4
+#define SIGNATURE_SIZE (SIGNATURE_GRID * SIGNATURE_GRID * 3)
+
+/* mean channel difference of signatures considered near-duplicates */
+#define SIGNATURE_THRESHOLD 10.0f
+
+/* binary palette cache record, version is bumped on every layout change */
+#define CACHE_MAGIC "HWPC"
+#define CACHE_VERSION 2
+
+/* cache database: index slots it starts with, it's rebuilt twice as big at half load;
+ * version of header and slot layout, bumped on every change of them. Database of
+ * other version is not read, it starts over on next store and its files are left
+ * for --cache-gc to collect once new database is there
+ *   2: slots keep access stamp and size, header keeps size of live entries
+ *   3: signatures of live raw entries follow index */
+#define CACHE_DB_MAGIC "HWDB"
+#define CACHE_DB_VERSION 3
+#define TEMPLATE_CACHE_MAGIC "HWTP"
+
+/* compiled template layout, bumped on every change of header or ops,
+ * independent of palette records (1 and 2 were stamped with CACHE_VERSION)
+ *   3: source path follows pool, so --cache-gc drops programs of removed templates */
+#define TEMPLATE_CACHE_VERSION 3
+#define CACHE_DB_SLOTS 1024
+
+/* access stamps are refreshed on lookup at most once a day, LRU order is that coarse */
+#define CACHE_STAMP_GRANULARITY (24 * 60 * 60)
+
+/* persisted histogram cells are 5 bits per channel */
+#define SPARSE_HISTOGRAM_BITS 5
+#define SPARSE_HISTOGRAM_CELLS (1 << (3 * SPARSE_HISTOGRAM_BITS))
+
+/* magic of .hist files, digit is bumped on every layout change */
+#define SPARSE_HISTOGRAM_MAGIC "HWH2"
+
+/* pixels and k-means iterations used to refine a warm-start palette */
+#define WARM_START_SAMPLE 65536
+#define WARM_START_ITERATIONS 3
+
+/* pixel weights are in [1, WEIGHT_MAX], keeps weighted histogram in 32 bits */
+#define WEIGHT_MAX 15
+
+/*
+ * histogram kernel specialized for bins per channel,
+ * bins = 1 << bits, binning is shift-only: value >> (8 - bits),
+ * weighted variant adds pixel weight instead of 1
+ */
+#define HISTOGRAM_BIN(px, bits) \
+    ((((px)[0] >> (8 - bits)) << (2 * bits)) | (((px)[1] >> (8 - bits)) << bits) | ((px)[2] >> (8 - bits)))
+
+#define HISTOGRAM_KERNEL(bits) \
+    void histogram_kernel_##bits(const uint8_t *pixels, size_t count, unsigned *histogram) \
+    { \
+        for (size_t i = 0; i < count; i++, pixels += 3) \
+            histogram[HISTOGRAM_BIN(pixels, bits)]++; \
+    } \
+    void histogram_kernel_weighted_##bits(const uint8_t *pixels, const uint8_t *weights, size_t count, unsigned *histogram) \
+    { \
+        for (size_t i = 0; i < count; i++, pixels += 3) \
+            histogram[HISTOGRAM_BIN(pixels, bits)] += weights[i]; \
+    }
 
 /* set default value for global char* variables */
 #define SET_DEF(x, s) \
@@ -179,6 +307,15 @@ typedef struct
 typedef struct
 {
     RGB colors[PALETTE_SIZE];
+
+    /* colors of quantizer boxes before blending, cached for warm start */
+    RGB boxes[PALETTE_SIZE / 2];
+    uint8_t has_boxes;
+
+    /* xterm-256 extended colors (16 .. size-1), sized to match,
+     * NULL when size is just PALETTE_SIZE - it's the fast path */
+    RGB *extended;
+    unsigned size;
 } PALETTE;
 
 /* TEMPLATE
@@ -191,9 +328,223 @@ typedef struct
     char *content;
 } TEMPLATE;
 
+/* TEMPLATE_PROGRAM
+ *
+ * template compiled to instructions, literal text and alpha
+ * suffixes of colors live in pool, so rendering does no parsing */
+enum TEMPLATE_OP_CODE { TEMPLATE_OP_LITERAL, TEMPLATE_OP_COLOR, TEMPLATE_OP_WALLPAPER };
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t type;      /* COLOR_TYPES of color */
+    uint16_t slot;     /* palette index of color */
+    uint32_t offset;   /* literal or color suffix in pool */
+    uint32_t len;
+} TEMPLATE_OP;
+
+/* STRBUF
+ *
+ * growing output buffer, length is tracked
+ * so appending does not rescan the content */
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} STRBUF;
+
+typedef struct
+{
+    TEMPLATE_OP *ops;
+    uint32_t count;
+    uint32_t cap;
+    STRBUF pool;
+} TEMPLATE_PROGRAM;
+
+/* compiled template cached on disk, valid while source keeps its mtime and size */
+typedef struct
+{
+    char magic[4];       /* TEMPLATE_CACHE_MAGIC */
+    uint32_t version;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint32_t count;
+    uint32_t pool_len;
+    uint32_t path_len;   /* source path after pool */
+    uint32_t reserved;
+    uint64_t checksum;   /* of ops and pool */
+} TEMPLATE_PROGRAM_HEADER;
+
+/* HISTOGRAM_KERNEL - shift-only binning kernel for given bins */
+typedef void (*histogram_kernel_t)(const uint8_t *pixels, size_t count, unsigned *histogram);
+typedef void (*histogram_kernel_weighted_t)(const uint8_t *pixels, const uint8_t *weights, size_t count, unsigned *histogram);
+
+typedef struct
+{
+    unsigned bins;
+    unsigned bits;
+    histogram_kernel_t kernel;
+    histogram_kernel_weighted_t weighted;
+} HISTOGRAM_KERNEL_T;
+
+/* WEIGHTING - how pixels are weighted in histogram and box sums */
+enum WEIGHTING { WEIGHT_NONE, WEIGHT_CENTER, WEIGHT_EDGE, WEIGHT_SALIENCY };
+
+/* ONLINE_QUANTIZER
+ *
+ * streaming palette state, updated block of rows at a time
+ * with sequential k-means, memory is O(palette + bins),
+ * no full image buffer is needed */
+typedef struct
+{
+    float centroids[PALETTE_SIZE / 2][3];
+    unsigned long counts[PALETTE_SIZE / 2];
+    size_t used; /* centroids spawned so far */
+
+    const HISTOGRAM_KERNEL_T *hk;
+    unsigned *histogram;
+
+    /* sample regions {x0, x1, y0, y1} and their R, G, B, count sums */
+    size_t regions[SAMPLE_REGIONS][4];
+    unsigned long region_sums[SAMPLE_REGIONS][4];
+
+    unsigned width;
+    unsigned height;
+    size_t row; /* rows consumed so far */
+} ONLINE_QUANTIZER;
+
+/* SPARSE_HISTOGRAM
+ *
+ * persisted per-image histogram, 15-bit cells (r5 << 10 | g5 << 5 | b5)
+ * with counts, only occupied cells are stored. Header is written as is,
+ * entry is keyed by image contents so it can't get stale, checksum
+ * covers header before it, cell index and counts */
+typedef struct
+{
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t cells;
+    RGB samples[SAMPLE_REGIONS];
+    uint8_t signature[SIGNATURE_SIZE];
+    uint64_t checksum;
+} SPARSE_HISTOGRAM_HEADER;
+
+typedef struct
+{
+    SPARSE_HISTOGRAM_HEADER header;
+    uint16_t *index;
+    uint32_t *counts;
+} SPARSE_HISTOGRAM;
+
+/* PALETTE_RECORD
+ *
+ * binary palette cache entry, fixed size so it is read with one pread()
+ * and validated without parsing anything. Quantizer parameters tell if
+ * palette can be reused, checksum covers everything before it */
+enum CACHE_TIER { CACHE_TIER_RAW, CACHE_TIER_FINAL };
+
+/* how raw palette was made, histogram one is computed from cached sparse histogram */
+enum QUANTIZER_BACKEND { QUANTIZER_MEDIAN, QUANTIZER_PYRAMID, QUANTIZER_STREAM, QUANTIZER_HISTOGRAM };
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+
+    uint32_t bins;
+    uint8_t weighting;
+    uint8_t backend;   /* enum QUANTIZER_BACKEND */
+    uint8_t has_signature;
+    uint8_t tier;      /* enum CACHE_TIER */
+
+    uint32_t size;
+    uint8_t has_boxes;
+    uint8_t signature[SIGNATURE_SIZE];
+    RGB boxes[PALETTE_SIZE / 2];
+    RGB colors[PALETTE_MAX_SIZE];
+
+    uint64_t checksum;
+} PALETTE_RECORD;
+
+/* CACHE_DB
+ *
+ * all palette records in one append-only file:
+ *   header | index slots | signatures | records
+ * index is open-addressing with linear probing on record key,
+ * slot points to the newest record of its key (record + 1, 0 is empty)
+ * and keeps its access stamp and size for LRU eviction, header keeps
+ * size of all live entries, so limits are checked without any stat().
+ * Signature of every slot's raw record is kept next to index, so search
+ * for similar image reads only that compact table of live entries.
+ * Readers mmap the file under shared flock of the lock file, single
+ * writer appends under exclusive one, index is rebuilt into new file
+ * which is renamed over the old, so mapped readers are never affected */
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;    /* power of two */
+    uint32_t records;  /* appended, live or replaced */
+    uint32_t live;     /* occupied slots */
+    uint32_t reserved;
+    uint64_t bytes;    /* sum of bytes of live slots */
+} CACHE_DB_HEADER;
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t record;
+    uint32_t stamp;    /* last access, seconds since epoch */
+    uint32_t bytes;    /* record, slot and files kept next to it */
+    uint32_t flags;    /* CACHE_SLOT_SIGNED */
+} CACHE_DB_SLOT;
+
+/* raw record with signature and box colors, its signature is in the table */
+#define CACHE_SLOT_SIGNED 1
+
+/* called for every signed live entry in cache_db_scan_signatures(), non-zero stops it */
+typedef int (*cache_db_signature_callback_t)(uint64_t key, const uint8_t *signature, void *ctx);
+
+/* called by streaming decoder for every block of decoded rows */
+typedef void (*row_callback_t)(void *ctx, unsigned width, unsigned height, const uint8_t *rows, size_t count);
+
 /* COLOR_TYPES - helps to manage colors within the code */
 enum COLOR_TYPES { HEX_t, RGB_t, R_t, G_t, B_t };
 
+/* what template and theme variable names stand for, see resolve_variable() */
+enum VARIABLE_KIND { VAR_NONE, VAR_COLOR, VAR_ALIAS, VAR_WALLPAPER };
+#define COLOR_FORMATS 5
+
+/* COLOR_TABLE
+ *
+ * every color of palette in every format, formatted once
+ * per palette so templates and terminals only copy them */
+typedef struct
+{
+    char text[PALETTE_MAX_SIZE][COLOR_FORMATS][16]; /* "255, 255, 255" at most */
+    uint8_t len[PALETTE_MAX_SIZE][COLOR_FORMATS];
+    unsigned size;
+} COLOR_TABLE;
+
+/* template_write() results */
+enum TEMPLATE_WRITE_RESULT { TEMPLATE_WRITE_FAILED, TEMPLATE_WRITE_DONE, TEMPLATE_WRITE_UNCHANGED };
+
+/* templates rendered in parallel, each thread takes next one */
+typedef struct
+{
+    TEMPLATE **templates;
+    size_t count;
+    const COLOR_TABLE *colors;
+    char *dir;           /* where outputs are written */
+    char *compare_dir;   /* with --generations, current generation */
+    int *results;        /* TEMPLATE_WRITE_RESULT of every template */
+    atomic_size_t next;
+} TEMPLATE_JOBS;
+
 /***
  * GLOBAL VARIABLES
  ***/
@@ -287,6 +638,57 @@ struct {
     float BRIGHTNESS_OFFSET;
     float DARKNESS_OFFSET;
     float OFFSET_GLOBAL;
+
+    /* number of colors in palette, 16 by default,
+     * up to 256 for xterm extended palettes */
+    unsigned PALETTE_COLORS;
+
+    /* histogram bins per channel, one of HISTOGRAM_KERNELS */
+    unsigned BINS_COUNT;
+
+    /* optional pixel weighting: center falloff, edges or local contrast */
+    enum WEIGHTING WEIGHTING;
+
+    /* quantize rows while decoding, without full image buffer */
+    uint8_t STREAMING : 1;
+
+    /* compute palette on reduced image, refine only ambiguous pixels */
+    uint8_t PYRAMID : 1;
+
+    /* apply palette from tiny sample first, refine it in background */
+    uint8_t PROGRESSIVE : 1;
+
+    /* do not seed quantizer with palettes of similar cached images */
+    uint8_t NO_WARM_START : 1;
+
+    /* persist image histogram, re-quantize from it without decoding */
+    uint8_t HISTOGRAM_CACHE : 1;
+
+    /* also export cached palettes as human readable .hellwal files */
+    uint8_t CACHE_TEXT : 1;
+
+    /* compact cache, evict entries over limits and exit */
+    uint8_t CACHE_GC : 1;
+
+    /* cache limits, least recently used entries are evicted, 0 is unlimited */
+    size_t CACHE_MAX_SIZE;
+    unsigned CACHE_MAX_ENTRIES;
+
+    /* fill palette cache for images in directory and exit */
+    char *PREWARM;
+    uint8_t RECURSIVE : 1;
+
+    /* number of parallel jobs, 0 is number of cpus */
+    unsigned JOBS;
+
+    /* fdatasync template outputs before they replace old ones */
+    uint8_t DURABLE : 1;
+
+    /* render templates into new generation dir, then swap 'current' symlink to it */
+    uint8_t GENERATIONS : 1;
+
+    /* point 'current' back to previous generation and exit */
+    uint8_t ROLLBACK : 1;
 } ARGS = {
     .IMAGE = NULL,
     .QUIET = 0,
@@ -312,7 +714,41 @@ struct {
     .GRAY_SCALE = -1.0f,
     .BRIGHTNESS_OFFSET = -1.0f,
     .DARKNESS_OFFSET = -1.0f,
-    .OFFSET_GLOBAL = 0.0f
+    .OFFSET_GLOBAL = 0.0f,
+    .PALETTE_COLORS = PALETTE_SIZE,
+    .BINS_COUNT = BINS,
+    .WEIGHTING = WEIGHT_NONE,
+    .STREAMING = 0,
+    .PYRAMID = 0,
+    .PROGRESSIVE = 0,
+    .NO_WARM_START = 0,
+    .HISTOGRAM_CACHE = 0,
+    .CACHE_TEXT = 0,
+    .CACHE_GC = 0,
+    .CACHE_MAX_SIZE = 0,
+    .CACHE_MAX_ENTRIES = 0,
+    .PREWARM = NULL,
+    .RECURSIVE = 0,
+    .JOBS = 0,
+    .DURABLE = 0,
+    .GENERATIONS = 0,
+    .ROLLBACK = 0
+};
+
+/* image kept for background refinement in progressive mode */
+IMG *PROGRESSIVE_IMG = NULL;
+
+/* instantiate histogram kernels for 4, 8, 16 and 32 bins */
+HISTOGRAM_KERNEL(2)
+HISTOGRAM_KERNEL(3)
+HISTOGRAM_KERNEL(4)
+HISTOGRAM_KERNEL(5)
+
+const HISTOGRAM_KERNEL_T HISTOGRAM_KERNELS[] = {
+    {  4, 2, histogram_kernel_2, histogram_kernel_weighted_2 },
+    {  8, 3, histogram_kernel_3, histogram_kernel_weighted_3 },
+    { 16, 4, histogram_kernel_4, histogram_kernel_weighted_4 },
+    { 32, 5, histogram_kernel_5, histogram_kernel_weighted_5 },
 };
 
 /* default color template to save cached themes */
@@ -403,6 +839,10 @@ void log_c(const char *format, ...);
 /* IMG */
 IMG *img_load(char *filename);
 void img_free(IMG *img);
+int img_stream_rows(char *filename, row_callback_t cb, void *ctx);
+int jpeg_stream_rows(FILE *f, row_callback_t cb, void *ctx);
+int png_stream_rows(FILE *f, row_callback_t cb, void *ctx);
+long pnm_header_value(FILE *f);
 
 /* color related stuff */
 int hex_to_rgb(const char *hex, RGB *p);
@@ -410,28 +850,111 @@ int get_channel(RGB *colors, size_t start, size_t end, int channel);
 int is_color_too_similar(RGB *palette, int num_colors, RGB new_color);
 
 RGB apply_offsets(RGB c);
+RGB palette_get(const PALETTE *p, unsigned i);
 RGB apply_grayscale(RGB c);
-RGB bin_to_color(int r_bin, int g_bin, int b_bin);
-RGB average_color(IMG *img, size_t start, size_t end);
+RGB bin_to_color(int r_bin, int g_bin, int b_bin, unsigned bits);
+const HISTOGRAM_KERNEL_T *get_histogram_kernel(unsigned bins);
+RGB average_color(IMG *img, const uint8_t *weights, size_t start, size_t end);
+RGB region_color(IMG *img, const uint8_t *weights, size_t region);
+void sample_region_rect(size_t w, size_t h, size_t region, size_t rect[4]);
 
 void print_color(RGB c);
 void print_term_colors();
 void print_term_colors_small();
-void median_cut(RGB *colors, size_t *starts, size_t *ends, size_t *num_boxes, size_t target_boxes);
+void median_cut(RGB *colors, uint8_t *weights, size_t *starts, size_t *ends, size_t *num_boxes, size_t target_boxes);
+int box_range(RGB *colors, size_t start, size_t end, int *channel);
 
 /* term, set for all active terminals ANSI escape codes */
-void set_term_colors(PALETTE pal);
+void set_term_colors(const COLOR_TABLE *colors);
+
+/* streaming quantizer */
+void oq_init(ONLINE_QUANTIZER *q, unsigned width, unsigned height);
+void oq_update(ONLINE_QUANTIZER *q, const uint8_t *rows, size_t count);
+void oq_rows_callback(void *ctx, unsigned width, unsigned height, const uint8_t *rows, size_t count);
+PALETTE oq_finish(ONLINE_QUANTIZER *q);
+PALETTE gen_palette_streaming(char *filename);
+
+/* progressive */
+IMG *img_sample(IMG *img, size_t target);
+float palette_distance(PALETTE *a, PALETTE *b);
+void apply_palette(PALETTE pal);
+void progressive_refine(PALETTE shown);
+int run_lock(int create);
+void run_token(char *buf, size_t size, pid_t pid);
+void run_token_write(void);
+int run_token_current(const char *token);
+int is_image_file(const char *name);
+void collect_images(const char *path, char ***files, size_t *count);
+void set_background_priority(void);
+void prewarm(char *dir);
+
+/* coarse-to-fine */
+int pyramid_box_colors(IMG *img, const uint8_t *weights, const HISTOGRAM_KERNEL_T *hk, unsigned *histogram, RGB *out);
+size_t nearest_color(const RGB *colors, size_t count, RGB c, float *best, float *second);
+
+/* pixel weights */
+uint8_t *gen_weights(IMG *img);
+enum WEIGHTING parse_weighting(const char *str);
+
+/* warm start from similar cached images */
+void img_signature(IMG *img, uint8_t *signature);
+float signature_distance(const uint8_t *a, const uint8_t *b);
+int find_similar_palette(const uint8_t *signature, RGB *seed);
+void warm_box_colors(IMG *img, const uint8_t *weights, const RGB *seed, RGB *out);
+
+/* cache keys */
+uint64_t hash_bytes(const uint8_t *data, size_t len, uint64_t seed);
+int file_hash(const char *filepath, uint64_t *hash);
+int cache_key(const char *filepath, char *key);
+void cache_init(void);
+char *cache_entry_path(const char *filepath, const char *ext);
+
+/* cache database */
+char *cache_db_path(const char *ext);
+int cache_db_lock(int operation);
+int cache_db_lookup(uint64_t key, PALETTE_RECORD *r);
+int cache_db_store(const PALETTE_RECORD *r, size_t bytes);
+int cache_db_rebuild(int fd, const CACHE_DB_HEADER *h, uint32_t slots, const uint8_t *keep);
+uint32_t cache_db_select_lru(const CACHE_DB_SLOT *index, uint32_t slots, uint8_t *keep, uint64_t *victims);
+void cache_db_scan_signatures(cache_db_signature_callback_t cb, void *ctx);
+void cache_gc(void);
+
+/* persisted sparse histogram */
+void quantizer_params(char *buf, size_t size, enum QUANTIZER_BACKEND backend);
+void sparse_histogram_write(const char *filepath, IMG *img, const uint8_t *signature);
+int sparse_histogram_load(const char *filepath, SPARSE_HISTOGRAM *h);
+void sparse_histogram_free(SPARSE_HISTOGRAM *h);
+size_t sparse_histogram_boxes(const SPARSE_HISTOGRAM *h, size_t target, RGB *out);
+PALETTE gen_palette_histogram(const SPARSE_HISTOGRAM *h);
 
 /* palettes */
-PALETTE gen_palette(IMG *img);
+PALETTE gen_palette(IMG *img, const uint8_t *signature);
+int low_entropy_palette(IMG *img, PALETTE *palette);
+void histogram_top_bins(const unsigned *histogram, const HISTOGRAM_KERNEL_T *hk, RGB *out);
+void palette_assemble(PALETTE *palette, const RGB *box_colors, const RGB *bin_colors, const RGB *samples, size_t samples_count);
 PALETTE get_color_palette(PALETTE p);
 
-int is_color_palette_var(char *name);
+void palette_alloc_extended(PALETTE *p, unsigned size);
+void palette_extend_from_base(PALETTE *p, unsigned from);
+void gen_palette_extended(IMG *img, uint8_t *weights, PALETTE *p);
+
+int color_var_index(const char *name, size_t len, unsigned colors);
+enum VARIABLE_KIND resolve_variable(hell_span_t name, unsigned colors, int *slot);
 int check_cached_palette(char *filepath, PALETTE *p);
-void palette_write_cache(char *filepath, PALETTE *p);
-char *process_variable_alpha(char *color, char *value, enum COLOR_TYPES type);
-char *palette_color(PALETTE pal, unsigned c, enum COLOR_TYPES type);
-char *process_addtional_variables(char *color, char *right_token, enum COLOR_TYPES type);
+void palette_write_cache(char *filepath, PALETTE *p, const uint8_t *signature, enum QUANTIZER_BACKEND backend);
+void palette_export_text(const char *key, PALETTE *p, enum QUANTIZER_BACKEND backend);
+void palette_record_init(PALETTE_RECORD *r, const PALETTE *p, const uint8_t *signature, uint64_t key, enum CACHE_TIER tier, enum QUANTIZER_BACKEND backend);
+void palette_from_record(const PALETTE_RECORD *r, PALETTE *p);
+uint64_t final_palette_key(const char *filepath);
+int check_final_palette(char *filepath, PALETTE *p);
+void palette_write_final(char *filepath, PALETTE *p);
+int palette_record_valid(const PALETTE_RECORD *r, uint64_t key);
+int palette_record_params_match(const PALETTE_RECORD *r);
+char *process_variable_alpha(char *color, const char *value, enum COLOR_TYPES type);
+void color_table_init(COLOR_TABLE *colors, const PALETTE *p);
+const char *palette_color(const COLOR_TABLE *colors, unsigned c, enum COLOR_TYPES type);
+int format_color(char *buf, size_t size, RGB col, enum COLOR_TYPES type);
+char *process_addtional_variables(char *color, const char *right_token, enum COLOR_TYPES type);
 
 void invert_palette(PALETTE *p);
 void print_palette(PALETTE pal);
@@ -446,10 +969,32 @@ void check_palette_contrast(PALETTE *palette);
 
 /* templates */
 char *load_file(char *filename);
-void process_templating(PALETTE pal);
-size_t template_write(TEMPLATE *t, char *dir);
-enum COLOR_TYPES parse_color_type(const char *str);
-void process_template(TEMPLATE *t, PALETTE pal);
+void strbuf_init(STRBUF *b, size_t cap);
+void strbuf_append(STRBUF *b, const char *s, size_t n);
+char *template_extend(const char *base, const char *after, const char *line_fmt);
+void process_templating(const COLOR_TABLE *colors);
+int _compare_template_qsort(const void *a, const void *b);
+void *template_worker(void *arg);
+char *generation_dir(const char *name);
+char *generation_link_target(const char *link);
+int generation_link_swap(const char *link, const char *name);
+void generation_remove(const char *name);
+int generation_lock(const char *name, int operation);
+void generation_prune(const char *keep, const char *keep_previous);
+void generation_rollback(void);
+int file_content_equals(const char *path, const char *data, size_t len);
+int template_write(TEMPLATE *t, char *dir);
+enum COLOR_TYPES parse_color_type(hell_span_t str);
+void template_program_init(TEMPLATE_PROGRAM *prog, size_t len);
+void template_program_free(TEMPLATE_PROGRAM *prog);
+void template_emit(TEMPLATE_PROGRAM *prog, uint8_t op, unsigned slot, enum COLOR_TYPES type, const char *s, size_t n);
+void template_emit_literal(TEMPLATE_PROGRAM *prog, const char *s, size_t n);
+int template_compile(const char *src, TEMPLATE_PROGRAM *prog);
+int template_program_load(const char *path, TEMPLATE_PROGRAM *prog, struct stat *st);
+void template_program_store(const char *path, const TEMPLATE_PROGRAM *prog, const struct stat *st);
+size_t template_program_gc(void);
+void template_render(const TEMPLATE_PROGRAM *prog, const COLOR_TABLE *colors, STRBUF *out);
+void process_template(TEMPLATE *t, const COLOR_TABLE *colors);
 TEMPLATE **get_template_structure_dir(const char *dir_path, size_t *_size);
 
 /* themes */
@@ -484,6 +1029,24 @@ void hellwal_usage(const char *name)
     printf("  -g, --gray-scale         <value>   Apply grayscale filter   (0-1) (float)\n");
     printf("  -n, --dark-offset        <value>   Adjust darkness offset   (0-1) (float)\n");
     printf("  -b, --bright-offset      <value>   Adjust brightness offset (0-1) (float)\n");
+    printf("  -B, --bins               <value>   Histogram bins per channel (4, 8, 16, 32)\n");
+    printf("  -w, --weighting          <mode>    Weight pixels by: none, center, edge, saliency\n");
+    printf("  --stream                           Quantize rows in one pass, PPM (JPEG/PNG if built with them) without whole image\n");
+    printf("  --pyramid                          Coarse-to-fine palette, refine only ambiguous pixels\n");
+    printf("  --progressive                      Apply quick palette first, refine it in background\n");
+    printf("  --no-warm-start                    Do not seed colors with palettes of similar cached images\n");
+    printf("  --histogram-cache                  Keep image histogram, re-quantize from it without decoding\n");
+    printf("  --cache-text                       Also export cached palettes as text .hellwal files\n");
+    printf("  --cache-max-size         <size>    Evict least recently used palettes above size (e.g. 50M)\n");
+    printf("  --cache-max-entries      <value>   Evict least recently used palettes above count\n");
+    printf("  --cache-gc                         Compact cache, drop evicted and stale entries and exit\n");
+    printf("  --prewarm                <dir>     Compute and cache palettes of all images in directory and exit\n");
+    printf("  --recursive                        Also prewarm images in subdirectories\n");
+    printf("  --jobs                   <value>   Parallel jobs for templates and prewarm, defaults to number of cpus\n");
+    printf("  --durable                          Sync template outputs to disk before replacing old ones\n");
+    printf("  --generations                      Render templates into new generation, switch 'current' link to it\n");
+    printf("  --rollback                         Switch 'current' link back to previous generation and exit\n");
+    printf("  -p, --palette-size       <value>   Number of palette colors (16-256), extended xterm palette\n");
     printf("  --check-contrast                   Ensure colors are readable against the background\n");
     printf("  --preview                          Preview current terminal colorscheme\n");
     printf("  --preview-small                    Preview current terminal colorscheme - small factor\n");
@@ -573,6 +1136,108 @@ int set_args(int argc, char *argv[])
         {
             ARGS.SKIP_LUMINANCE_SORTING = 1;
         }
+        else if (strcmp(argv[i], "--progressive") == 0)
+        {
+            ARGS.PROGRESSIVE = 1;
+        }
+        else if (strcmp(argv[i], "--no-warm-start") == 0)
+        {
+            ARGS.NO_WARM_START = 1;
+        }
+        else if (strcmp(argv[i], "--histogram-cache") == 0)
+        {
+            ARGS.HISTOGRAM_CACHE = 1;
+        }
+        else if (strcmp(argv[i], "--cache-text") == 0)
+        {
+            ARGS.CACHE_TEXT = 1;
+        }
+        else if (strcmp(argv[i], "--cache-gc") == 0)
+        {
+            ARGS.CACHE_GC = 1;
+        }
+        else if (strcmp(argv[i], "--cache-max-size") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                char *end;
+                double n = strtod(argv[++i], &end);
+                double unit = 1;
+
+                switch (*end)
+                {
+                    case 'k': case 'K': unit = 1024.0; end++; break;
+                    case 'm': case 'M': unit = 1024.0 * 1024; end++; break;
+                    case 'g': case 'G': unit = 1024.0 * 1024 * 1024; end++; break;
+                }
+
+                if (*end == '\0' && n > 0)
+                    ARGS.CACHE_MAX_SIZE = (size_t)(n * unit);
+                else
+                    warn("Cache size has to be positive number of bytes, K, M or G!, skipping argument.");
+            }
+            else
+                argc = -1;
+        }
+        else if (strcmp(argv[i], "--prewarm") == 0)
+        {
+            if (i + 1 < argc)
+                ARGS.PREWARM = argv[++i];
+            else
+                argc = -1;
+        }
+        else if (strcmp(argv[i], "--recursive") == 0)
+        {
+            ARGS.RECURSIVE = 1;
+        }
+        else if (strcmp(argv[i], "--jobs") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                char *end;
+                long n = strtol(argv[++i], &end, 10);
+                if (*end == '\0' && n > 0)
+                    ARGS.JOBS = (unsigned)n;
+                else
+                    warn("Jobs have to be positive integer!, skipping argument.");
+            }
+            else
+                argc = -1;
+        }
+        else if (strcmp(argv[i], "--durable") == 0)
+        {
+            ARGS.DURABLE = 1;
+        }
+        else if (strcmp(argv[i], "--generations") == 0)
+        {
+            ARGS.GENERATIONS = 1;
+        }
+        else if (strcmp(argv[i], "--rollback") == 0)
+        {
+            ARGS.ROLLBACK = 1;
+        }
+        else if (strcmp(argv[i], "--cache-max-entries") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                char *end;
+                long n = strtol(argv[++i], &end, 10);
+                if (*end == '\0' && n > 0)
+                    ARGS.CACHE_MAX_ENTRIES = (unsigned)n;
+                else
+                    warn("Cache entries have to be positive integer!, skipping argument.");
+            }
+            else
+                argc = -1;
+        }
+        else if (strcmp(argv[i], "--pyramid") == 0)
+        {
+            ARGS.PYRAMID = 1;
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            ARGS.STREAMING = 1;
+        }
         else if (strcmp(argv[i], "--debug") == 0)
         {
             ARGS.DEBUG = 1;
@@ -666,6 +1331,41 @@ int set_args(int argc, char *argv[])
             else
                 argc = -1;
         }
+        else if ((strcmp(argv[i], "--bins") == 0 || strcmp(argv[i], "-B") == 0))
+        {
+            if (i + 1 < argc)
+            {
+                char *end;
+                long n = strtol(argv[++i], &end, 10);
+                if (*end == '\0' && n > 0 && get_histogram_kernel((unsigned)n) != NULL)
+                    ARGS.BINS_COUNT = (unsigned)n;
+                else
+                    warn("Bins value have to be one of 4, 8, 16, 32!, skipping argument.");
+            }
+            else
+                argc = -1;
+        }
+        else if ((strcmp(argv[i], "--weighting") == 0 || strcmp(argv[i], "-w") == 0))
+        {
+            if (i + 1 < argc)
+                ARGS.WEIGHTING = parse_weighting(argv[++i]);
+            else
+                argc = -1;
+        }
+        else if ((strcmp(argv[i], "--palette-size") == 0 || strcmp(argv[i], "-p") == 0))
+        {
+            if (i + 1 < argc)
+            {
+                char *end;
+                long n = strtol(argv[++i], &end, 10);
+                if (*end == '\0' && n >= PALETTE_SIZE && n <= PALETTE_MAX_SIZE)
+                    ARGS.PALETTE_COLORS = (unsigned)n;
+                else
+                    warn("Palette size have to be integer between %d-%d!, skipping argument.", PALETTE_SIZE, PALETTE_MAX_SIZE);
+            }
+            else
+                argc = -1;
+        }
         else if (strcmp(argv[i], "--static-background") == 0)
         {
             if (i + 1 < argc)
@@ -710,7 +1410,7 @@ int set_args(int argc, char *argv[])
     if (ARGS.RANDOM != 0 && (ARGS.THEME_FOLDER == NULL && ARGS.IMAGE == NULL))
         err("you have to specify --image to provide image folder or --theme-folder to use RANDOM");
 
-    if (ARGS.IMAGE == NULL && ARGS.THEME == NULL && ((ARGS.THEME_FOLDER == NULL || ARGS.TEMPLATE_FOLDER == NULL) && ARGS.RANDOM == 0))
+    if (ARGS.CACHE_GC == 0 && ARGS.ROLLBACK == 0 && ARGS.PREWARM == NULL && ARGS.IMAGE == NULL && ARGS.THEME == NULL && ((ARGS.THEME_FOLDER == NULL || ARGS.TEMPLATE_FOLDER == NULL) && ARGS.RANDOM == 0))
         err("You have to provide image file or theme!:  --image,  --theme, \n\t");
 
     if ((ARGS.THEME != NULL || ARGS.THEME_FOLDER != NULL) && ARGS.IMAGE != NULL)
@@ -736,6 +1436,40 @@ int set_args(int argc, char *argv[])
             ARGS.THEME = rand_file(ARGS.THEME_FOLDER);
     }
 
+    if (ARGS.STREAMING != 0 && ARGS.WEIGHTING != WEIGHT_NONE)
+        warn("--weighting needs whole image, it's ignored with --stream");
+
+    if (ARGS.PROGRESSIVE != 0 && ARGS.JSON != 0)
+    {
+        warn("--progressive cannot be used with --json, it's ignored");
+        ARGS.PROGRESSIVE = 0;
+    }
+
+    if (ARGS.PROGRESSIVE != 0 && ARGS.STREAMING != 0)
+    {
+        warn("--progressive needs whole image, it's ignored with --stream");
+        ARGS.PROGRESSIVE = 0;
+    }
+
+    if (ARGS.PREWARM != NULL)
+    {
+        if (ARGS.NO_CACHE != 0)
+            err("--prewarm fills the cache, it cannot be used with --no-cache");
+        if (ARGS.THEME != NULL || ARGS.IMAGE != NULL || ARGS.RANDOM != 0)
+            warn("--prewarm only fills the cache, image and theme options are ignored");
+
+        /* only full palettes are cached */
+        ARGS.PROGRESSIVE = 0;
+        ARGS.THEME = NULL;
+        ARGS.RANDOM = 0;
+    }
+
+    if (ARGS.JOBS == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ARGS.JOBS = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
     /* set offset values - you can provide both, but they will interfier with each other */
     if (ARGS.DARKNESS_OFFSET != -1)
         ARGS.OFFSET_GLOBAL -= ARGS.DARKNESS_OFFSET;
@@ -1083,6 +1817,38 @@ int get_channel(RGB *colors, size_t start, size_t end, int channel)
     return max - min;
 }
 
+/*
+ * Get widest channel range of a box in one pass,
+ * channel is set to 0, 1 or 2 (R, G, B) - first wins on ties
+ */
+int box_range(RGB *colors, size_t start, size_t end, int *channel)
+{
+    uint8_t min_r = 255, min_g = 255, min_b = 255;
+    uint8_t max_r = 0, max_g = 0, max_b = 0;
+
+    for (size_t i = start; i < end; i++)
+    {
+        RGB c = colors[i];
+        if (c.R < min_r) min_r = c.R;
+        if (c.R > max_r) max_r = c.R;
+        if (c.G < min_g) min_g = c.G;
+        if (c.G > max_g) max_g = c.G;
+        if (c.B < min_b) min_b = c.B;
+        if (c.B > max_b) max_b = c.B;
+    }
+
+    int range_r = start < end ? max_r - min_r : 0;
+    int range_g = start < end ? max_g - min_g : 0;
+    int range_b = start < end ? max_b - min_b : 0;
+
+    int max_range = range_r;
+    *channel = 0;
+    if (range_g > max_range) { max_range = range_g; *channel = 1; }
+    if (range_b > max_range) { max_range = range_b; *channel = 2; }
+
+    return max_range;
+}
+
 /* ensure that new color is not too similar to existing colors in the palette */
 int is_color_too_similar(RGB *palette, int num_colors, RGB new_color)
 {
@@ -1094,20 +1860,38 @@ int is_color_too_similar(RGB *palette, int num_colors, RGB new_color)
     return 0;
 }
 
-/* calculate the average color of a given pixel range in an image */
-RGB average_color(IMG *img, size_t start, size_t end) 
+/*
+ * calculate the average color of a given pixel range in an image,
+ * if weights are provided every pixel counts weights[i] times
+ */
+RGB average_color(IMG *img, const uint8_t *weights, size_t start, size_t end) 
 {
     long sum_r = 0, sum_g = 0, sum_b = 0;
     size_t count = end - start;
-    if (count <= 0) count++;
 
-    for (size_t i = start; i < end; i++)
+    if (weights == NULL)
+    {
+        for (size_t i = start; i < end; i++)
+        {
+            sum_r += img->pixels[i * 3];
+            sum_g += img->pixels[i * 3 + 1];
+            sum_b += img->pixels[i * 3 + 2];
+        }
+    }
+    else
     {
-        sum_r += img->pixels[i * 3];
-        sum_g += img->pixels[i * 3 + 1];
-        sum_b += img->pixels[i * 3 + 2];
+        count = 0;
+        for (size_t i = start; i < end; i++)
+        {
+            sum_r += img->pixels[i * 3] * weights[i];
+            sum_g += img->pixels[i * 3 + 1] * weights[i];
+            sum_b += img->pixels[i * 3 + 2] * weights[i];
+            count += weights[i];
+        }
     }
 
+    if (count <= 0) count++;
+
     return clamp_rgb(
     (RGB)
     {
@@ -1117,18 +1901,85 @@ RGB average_color(IMG *img, size_t start, size_t end)
     });
 }
 
-/* convert bin indices to an rgb color */
-RGB bin_to_color(int r_bin, int g_bin, int b_bin)
+/*
+ * get rect {x0, x1, y0, y1} of sample region [0, SAMPLE_REGIONS):
+ * corners, center and quarters of image, block is 1/16
+ * of image in each dimension
+ */
+void sample_region_rect(size_t w, size_t h, size_t region, size_t rect[4])
+{
+    const size_t centers[SAMPLE_REGIONS][2] = {
+        { 0, 0 },
+        { 0, h - 1 },
+        { w - 1, h - 1 },
+        { w / 2, h / 2 },
+        { w / 4, h / 4 },
+        { 3 * (w / 4), h / 4 },
+        { w / 4, 3 * (h / 4) },
+        { 3 * (w / 4), 3 * (h / 4) }
+    };
+
+    size_t cx = centers[region][0], cy = centers[region][1];
+    size_t rx = w / 32 + 1;
+    size_t ry = h / 32 + 1;
+
+    rect[0] = cx > rx ? cx - rx : 0;
+    rect[1] = cx + rx < w ? cx + rx : w;
+    rect[2] = cy > ry ? cy - ry : 0;
+    rect[3] = cy + ry < h ? cy + ry : h;
+}
+
+/* average color of sample region, weighted if weights are provided */
+RGB region_color(IMG *img, const uint8_t *weights, size_t region)
+{
+    size_t rect[4];
+    sample_region_rect(img->width, img->height, region, rect);
+
+    size_t x0 = rect[0], x1 = rect[1];
+    size_t y0 = rect[2], y1 = rect[3];
+
+    unsigned long sum_r = 0, sum_g = 0, sum_b = 0, count = 0;
+
+    for (size_t y = y0; y < y1; y++)
+    {
+        const uint8_t *px = img->pixels + (y * img->width + x0) * 3;
+        for (size_t x = x0; x < x1; x++, px += 3)
+        {
+            unsigned w = weights ? weights[y * img->width + x] : 1;
+            sum_r += px[0] * w;
+            sum_g += px[1] * w;
+            sum_b += px[2] * w;
+            count += w;
+        }
+    }
+
+    if (count == 0)
+        return (RGB){0, 0, 0};
+
+    return (RGB){ sum_r / count, sum_g / count, sum_b / count };
+}
+
+/* convert bin indices to an rgb color, bins = 1 << bits */
+RGB bin_to_color(int r_bin, int g_bin, int b_bin, unsigned bits)
 {
     return clamp_rgb(
     (RGB)
     {
-        .R = r_bin * (256 / BINS),
-        .G = g_bin * (256 / BINS),
-        .B = b_bin * (256 / BINS)
+        .R = r_bin << (8 - bits),
+        .G = g_bin << (8 - bits),
+        .B = b_bin << (8 - bits)
     });
 }
 
+/* get specialized histogram kernel for bins, NULL if there is none */
+const HISTOGRAM_KERNEL_T *get_histogram_kernel(unsigned bins)
+{
+    for (size_t i = 0; i < sizeof(HISTOGRAM_KERNELS) / sizeof(HISTOGRAM_KERNELS[0]); i++)
+        if (HISTOGRAM_KERNELS[i].bins == bins)
+            return &HISTOGRAM_KERNELS[i];
+    return NULL;
+}
+
 void invert_palette(PALETTE *p)
 {
     if (p == NULL)
@@ -1140,6 +1991,21 @@ void invert_palette(PALETTE *p)
         p->colors[i].G = 255 - p->colors[i].G;
         p->colors[i].B = 255 - p->colors[i].B;
     }
+
+    for (unsigned i = 0; p->extended != NULL && i < p->size - PALETTE_SIZE; i++)
+    {
+        p->extended[i].R = 255 - p->extended[i].R;
+        p->extended[i].G = 255 - p->extended[i].G;
+        p->extended[i].B = 255 - p->extended[i].B;
+    }
+}
+
+/* get color [i] from palette, including extended ones */
+RGB palette_get(const PALETTE *p, unsigned i)
+{
+    if (i < PALETTE_SIZE)
+        return p->colors[i];
+    return p->extended[i - PALETTE_SIZE];
 }
 
 RGB apply_grayscale(RGB c)
@@ -1161,8 +2027,8 @@ RGB apply_offsets(RGB c)
     return c;
 }
 
-/* part of median algo */
-size_t partition_colors(RGB *colors, size_t start, size_t end, int channel, uint8_t pivot)
+/* part of median algo, weights (if any) are moved along with colors */
+size_t partition_colors(RGB *colors, uint8_t *weights, size_t start, size_t end, int channel, uint8_t pivot)
 {
     size_t left = start, right = end - 1;
     while (left <= right)
@@ -1174,14 +2040,42 @@ size_t partition_colors(RGB *colors, size_t start, size_t end, int channel, uint
             RGB temp = colors[left];
             colors[left] = colors[right];
             colors[right] = temp;
+
+            if (weights != NULL)
+            {
+                uint8_t w = weights[left];
+                weights[left] = weights[right];
+                weights[right] = w;
+            }
         }
     }
     return left;
 }
 
-/* perform median cut to partition the color space */
-void median_cut(RGB *colors, size_t *starts, size_t *ends, size_t *num_boxes, size_t target_boxes) 
+/*
+ * perform median cut to partition the color space,
+ * ranges of boxes are cached, so only the two halves
+ * of a split box are rescanned on each iteration
+ */
+void median_cut(RGB *colors, uint8_t *weights, size_t *starts, size_t *ends, size_t *num_boxes, size_t target_boxes) 
 {
+    if (*num_boxes >= target_boxes)
+        return;
+
+    int ranges_stack[PALETTE_SIZE], channels_stack[PALETTE_SIZE];
+    int *ranges = ranges_stack, *channels = channels_stack;
+
+    if (target_boxes > PALETTE_SIZE)
+    {
+        ranges = malloc(target_boxes * sizeof(int));
+        channels = malloc(target_boxes * sizeof(int));
+        if (ranges == NULL || channels == NULL)
+            err("Failed to allocate memory for median cut");
+    }
+
+    for (size_t i = 0; i < *num_boxes; i++)
+        ranges[i] = box_range(colors, starts[i], ends[i], &channels[i]);
+
     while (*num_boxes < target_boxes)
     {
         size_t largest_segment_index = 0;
@@ -1189,35 +2083,37 @@ void median_cut(RGB *colors, size_t *starts, size_t *ends, size_t *num_boxes, si
 
         for (size_t i = 0; i < *num_boxes; i++)
         {
-            size_t start = starts[i];
-            size_t end = ends[i];
-            int range_r = get_channel(colors, start, end, 0);
-            int range_g = get_channel(colors, start, end, 1);
-            int range_b = get_channel(colors, start, end, 2);
-            int max_range = fmax(range_r, fmax(range_g, range_b));
-            if (max_range > largest_range) {
-                largest_range = max_range;
+            if (ranges[i] > largest_range) {
+                largest_range = ranges[i];
                 largest_segment_index = i;
             }
         }
 
         size_t start = starts[largest_segment_index];
         size_t end = ends[largest_segment_index];
-        int channel = (largest_range == get_channel(colors, start, end, 0)) ? 0 :
-                      (largest_range == get_channel(colors, start, end, 1)) ? 1 : 2;
+        int channel = channels[largest_segment_index];
 
         size_t mid = (end - start) / 2;
         uint8_t pivot = ((uint8_t *)&colors[start + mid])[channel];
 
-        size_t median = partition_colors(colors, start, end, channel, pivot);
+        size_t median = partition_colors(colors, weights, start, end, channel, pivot);
 
         // Update the segments
         starts[largest_segment_index] = start;
         ends[largest_segment_index] = median;
         starts[*num_boxes] = median;
         ends[*num_boxes] = end;
+
+        ranges[largest_segment_index] = box_range(colors, start, median, &channels[largest_segment_index]);
+        ranges[*num_boxes] = box_range(colors, median, end, &channels[*num_boxes]);
         (*num_boxes)++;
     }
+
+    if (ranges != ranges_stack)
+    {
+        free(ranges);
+        free(channels);
+    }
 }
 
 /* Compares every color in the palette against the background and checks their
@@ -1277,6 +2173,12 @@ void check_palette_contrast(PALETTE *palette)
     }
 }
 
+/* quantizer backend configured by arguments, histogram one is used only when it's cached */
+static enum QUANTIZER_BACKEND quantizer_backend(void)
+{
+    return ARGS.STREAMING ? QUANTIZER_STREAM : (ARGS.PYRAMID ? QUANTIZER_PYRAMID : QUANTIZER_MEDIAN);
+}
+
 PALETTE get_color_palette(PALETTE p)
 {
     if (ARGS.THEME)
@@ -1286,10 +2188,43 @@ PALETTE get_color_palette(PALETTE p)
     else
     {
         if (!check_cached_palette(ARGS.IMAGE, &p)) {
-            IMG *img = img_load(ARGS.IMAGE);
-            p = gen_palette(img);
-            palette_write_cache(ARGS.IMAGE, &p);
-            img_free(img);
+            if (ARGS.STREAMING != 0)
+            {
+                p = gen_palette_streaming(ARGS.IMAGE);
+                palette_write_cache(ARGS.IMAGE, &p, NULL, quantizer_backend());
+            }
+            else if (ARGS.PROGRESSIVE != 0)
+            {
+                /* full palette is computed (and cached) by progressive_refine() */
+                PROGRESSIVE_IMG = img_load(ARGS.IMAGE);
+                IMG *sample = img_sample(PROGRESSIVE_IMG, PROGRESSIVE_SAMPLE);
+                p = gen_palette(sample, NULL);
+                img_free(sample);
+                return p;
+            }
+            else
+            {
+                SPARSE_HISTOGRAM h;
+                if (ARGS.HISTOGRAM_CACHE != 0 && sparse_histogram_load(ARGS.IMAGE, &h))
+                {
+                    p = gen_palette_histogram(&h);
+                    palette_write_cache(ARGS.IMAGE, &p, h.header.signature, QUANTIZER_HISTOGRAM);
+                    sparse_histogram_free(&h);
+                    return p;
+                }
+
+                uint8_t signature[SIGNATURE_SIZE];
+                IMG *img = img_load(ARGS.IMAGE);
+                img_signature(img, signature);
+
+                /* before gen_palette(), median cut reorders pixels */
+                if (ARGS.HISTOGRAM_CACHE != 0)
+                    sparse_histogram_write(ARGS.IMAGE, img, signature);
+
+                p = gen_palette(img, signature);
+                img_free(img);
+                palette_write_cache(ARGS.IMAGE, &p, signature, quantizer_backend());
+            }
         }
     }
 
@@ -1334,6 +2269,14 @@ void apply_addtional_arguments(PALETTE *p)
             if (ARGS.GRAY_SCALE != -1)
                 p->colors[i] = apply_grayscale(p->colors[i]);
         }
+
+        for (unsigned i = 0; p->extended != NULL && i < p->size - PALETTE_SIZE; i++)
+        {
+            if (ARGS.OFFSET_GLOBAL != 0)
+                p->extended[i] = apply_offsets(p->extended[i]);
+            if (ARGS.GRAY_SCALE != -1)
+                p->extended[i] = apply_grayscale(p->extended[i]);
+        }
     }
 
     if (ARGS.STATIC_BG != NULL)
@@ -1421,46 +2364,200 @@ void palette_handle_neon_mode(PALETTE *p)
             log_c("\n");
 }
 
-PALETTE gen_palette(IMG *img)
+enum WEIGHTING parse_weighting(const char *str)
 {
-    PALETTE palette;
-    size_t total_pixels = img->size / 3;
-    RGB *all_colors = (RGB *)img->pixels;
-    int num_colors = 0;
+    if (!strcmp(str, "center"))
+        return WEIGHT_CENTER;
+    if (!strcmp(str, "edge"))
+        return WEIGHT_EDGE;
+    if (!strcmp(str, "saliency"))
+        return WEIGHT_SALIENCY;
+    if (strcmp(str, "none"))
+        warn("Unknown weighting: \"%s\", using none.", str);
+
+    return WEIGHT_NONE;
+}
 
-    size_t starts[PALETTE_SIZE / 2] = {0};
-    size_t ends[PALETTE_SIZE / 2] = {total_pixels};
-    size_t num_boxes = 1;
+/* luminance coefficients (0.2126, 0.7152, 0.0722 in 1/256) repeated for a block of RGB bytes */
+static const uint8_t WEIGHT_LUMINANCE[WEIGHT_BLOCK] = {
+    54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19,
+    54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19, 54, 183, 19,
+};
+
+/* luminance sum of contiguous RGB bytes starting at pixel boundary, 256 times scaled */
+static uint32_t luminance_sum(const uint8_t *restrict px, size_t n)
+{
+    uint32_t sum = 0;
+    size_t i = 0;
+
+    for (; i + WEIGHT_BLOCK <= n; i += WEIGHT_BLOCK)
+        for (size_t k = 0; k < WEIGHT_BLOCK; k++)
+            sum += (uint32_t)px[i + k] * WEIGHT_LUMINANCE[k];
+    for (size_t k = 0; i + k < n; k++)
+        sum += (uint32_t)px[i + k] * WEIGHT_LUMINANCE[k];
+
+    return sum;
+}
+
+/*
+ * Compute per-pixel weights for histogram and box sums.
+ *
+ * Image is box-reduced to at most WEIGHT_MAP_SIZE on longest side,
+ * weights are computed on reduced luminance map:
+ *   - center:   quadratic falloff from center of image
+ *   - edge:     gradient magnitude, central differences
+ *   - saliency: local contrast, |luminance - box blurred luminance|
+ * and spread back to every pixel of its cell, in [1, WEIGHT_MAX].
+ *
+ * returns NULL if no weighting was requested, caller must free it
+ */
+uint8_t *gen_weights(IMG *img)
+{
+    if (ARGS.WEIGHTING == WEIGHT_NONE || img->width == 0 || img->height == 0)
+        return NULL;
+
+    const size_t w = img->width, h = img->height;
+    const size_t longest = w > h ? w : h;
+    const size_t f = (longest + WEIGHT_MAP_SIZE - 1) / WEIGHT_MAP_SIZE;
+    const size_t rw = (w + f - 1) / f, rh = (h + f - 1) / f;
+
+    float *lum = calloc(rw * rh, sizeof(float));
+    float *map = calloc(rw * rh, sizeof(float));
+    float *tmp = calloc(rw * rh, sizeof(float));
+    uint8_t *cells = malloc(rw * rh);
+    uint8_t *weights = malloc(w * h);
+
+    if (!lum || !map || !tmp || !cells || !weights)
+        err("Failed to allocate memory for pixel weights");
+
+    /* reduce: average luminance of every f*f cell, each cell row
+     * of image row is one contiguous run of bytes */
+    for (size_t y = 0; y < h; y++)
+    {
+        const uint8_t *px = img->pixels + y * w * 3;
+        float *row = lum + (y / f) * rw;
+        for (size_t cx = 0; cx < rw; cx++)
+        {
+            size_t x0 = cx * f, cw = x0 + f < w ? f : w - x0;
+            row[cx] += luminance_sum(px + x0 * 3, cw * 3);
+        }
+    }
+    for (size_t i = 0; i < rw * rh; i++)
+        lum[i] *= 1.0f / (f * f * 255.0f * 256.0f);
+
+    switch (ARGS.WEIGHTING) {
+    case WEIGHT_CENTER:
+        for (size_t y = 0; y < rh; y++)
+        {
+            float dy = (y + 0.5f) / rh - 0.5f;
+            for (size_t x = 0; x < rw; x++)
+            {
+                float dx = (x + 0.5f) / rw - 0.5f;
+                map[y * rw + x] = 1.0f - 2.0f * (dx * dx + dy * dy);
+            }
+        }
+        break;
+    case WEIGHT_EDGE:
+        for (size_t y = 0; y < rh; y++)
+        {
+            const float *up   = lum + (y > 0 ? y - 1 : y) * rw;
+            const float *down = lum + (y + 1 < rh ? y + 1 : y) * rw;
+            const float *row  = lum + y * rw;
+            for (size_t x = 0; x < rw; x++)
+            {
+                size_t l = x > 0 ? x - 1 : x, r = x + 1 < rw ? x + 1 : x;
+                map[y * rw + x] = fabsf(row[r] - row[l]) + fabsf(down[x] - up[x]);
+            }
+        }
+        break;
+    case WEIGHT_SALIENCY:
+    {
+        /* separable box blur, radius of 4 cells */
+        const size_t rad = 4;
+        for (size_t y = 0; y < rh; y++)
+            for (size_t x = 0; x < rw; x++)
+            {
+                size_t x0 = x > rad ? x - rad : 0, x1 = x + rad < rw ? x + rad + 1 : rw;
+                float sum = 0;
+                for (size_t k = x0; k < x1; k++)
+                    sum += lum[y * rw + k];
+                tmp[y * rw + x] = sum / (x1 - x0);
+            }
+
+        /* vertical pass runs along rows, so inner loop stays contiguous */
+        for (size_t y = 0; y < rh; y++)
+        {
+            size_t y0 = y > rad ? y - rad : 0, y1 = y + rad < rh ? y + rad + 1 : rh;
+            float *row = map + y * rw;
+            for (size_t k = y0; k < y1; k++)
+                for (size_t x = 0; x < rw; x++)
+                    row[x] += tmp[k * rw + x];
+            for (size_t x = 0; x < rw; x++)
+                row[x] = fabsf(lum[y * rw + x] - row[x] / (y1 - y0));
+        }
+        break;
+    }
+    case WEIGHT_NONE:
+        break;
+    }
 
-    median_cut(all_colors, starts, ends, &num_boxes, PALETTE_SIZE / 2);
+    /* normalize to [1, WEIGHT_MAX] */
+    float max = 0.0f;
+    for (size_t i = 0; i < rw * rh; i++)
+        max = map[i] > max ? map[i] : max;
 
-    int histogram[BINS][BINS][BINS] = {{{0}}};
-    for (size_t i = 0; i < total_pixels; i++)
+    const float scale = max > 0.0f ? (WEIGHT_MAX - 1) / max : 0.0f;
+    for (size_t i = 0; i < rw * rh; i++)
+        cells[i] = (uint8_t)(1.0f + map[i] * scale + 0.5f);
+
+    /* spread cells back to full resolution: first row of every cell row
+     * is filled cell by cell, the rest are its copies */
+    for (size_t y = 0; y < h; y++)
     {
-        int r_bin = img->pixels[i * 3] / (256 / BINS);
-        int g_bin = img->pixels[i * 3 + 1] / (256 / BINS);
-        int b_bin = img->pixels[i * 3 + 2] / (256 / BINS);
+        uint8_t *out = weights + y * w;
+        if (y % f != 0)
+        {
+            memcpy(out, out - w, w);
+            continue;
+        }
 
-        histogram[r_bin][g_bin][b_bin] = (histogram[r_bin][g_bin][b_bin] < INT_MAX) ? histogram[r_bin][g_bin][b_bin] + 1 : INT_MAX;
+        const uint8_t *cell = cells + (y / f) * rw;
+        for (size_t cx = 0; cx < rw; cx++)
+        {
+            size_t x0 = cx * f;
+            memset(out + x0, cell[cx], x0 + f < w ? f : w - x0);
+        }
     }
 
+    free(lum);
+    free(map);
+    free(tmp);
+    free(cells);
+
+    return weights;
+}
+
+/* get colors of PALETTE_SIZE/2 most populated histogram bins, most populated first */
+void histogram_top_bins(const unsigned *histogram, const HISTOGRAM_KERNEL_T *hk, RGB *out)
+{
     typedef struct {
         int count;
         int r_bin, g_bin, b_bin;
     } BinCount;
 
+    const unsigned bins = hk->bins, bits = hk->bits;
     BinCount top_bins[(PALETTE_SIZE / 2)] = {0};
 
-    for (int r = 0; r < BINS; r++)
+    for (unsigned r = 0; r < bins; r++)
     {
-        for (int g = 0; g < BINS; g++)
+        for (unsigned g = 0; g < bins; g++)
         {
-            for (int b = 0; b < BINS; b++)
+            for (unsigned b = 0; b < bins; b++)
             {
-                int count = histogram[r][g][b];
+                int count = (int)histogram[(r << (2 * bits)) | (g << bits) | b];
                 if (count > top_bins[(PALETTE_SIZE / 2) - 1].count)
                 {
-                    top_bins[(PALETTE_SIZE / 2) - 1] = (BinCount){count, r, g, b};
+                    top_bins[(PALETTE_SIZE / 2) - 1] = (BinCount){count, (int)r, (int)g, (int)b};
                     for (int k = (PALETTE_SIZE / 2) - 1; k > 0 && top_bins[k].count > top_bins[k - 1].count; k--)
                     {
                         BinCount temp = top_bins[k];
@@ -1472,10 +2569,22 @@ PALETTE gen_palette(IMG *img)
         }
     }
 
+    for (size_t i = 0; i < PALETTE_SIZE / 2; i++)
+        out[i] = bin_to_color(top_bins[i].r_bin, top_bins[i].g_bin, top_bins[i].b_bin, bits);
+}
+
+/*
+ * build palette from quantizer output: first half blends box colors
+ * with most populated bins, second half comes from region samples
+ */
+void palette_assemble(PALETTE *palette, const RGB *box_colors, const RGB *bin_colors, const RGB *samples, size_t samples_count)
+{
+    int num_colors = 0;
+
     for (size_t i = 0; i < PALETTE_SIZE / 2; i++)
     {
-        RGB avg_color = average_color(img, starts[i], ends[i]);
-        RGB bin_color = bin_to_color(top_bins[i].r_bin, top_bins[i].g_bin, top_bins[i].b_bin);
+        RGB avg_color = box_colors[i];
+        RGB bin_color = bin_colors[i];
         RGB blended_colors = blend_colors(avg_color, bin_color, 0.5f);
 
         if (ARGS.DEBUG != 0)
@@ -1497,220 +2606,2493 @@ PALETTE gen_palette(IMG *img)
             printf("\n\n");
         }
 
-        palette.colors[num_colors++] = blended_colors;
+        palette->colors[num_colors++] = blended_colors;
+        palette->boxes[i] = avg_color;
     }
+    palette->has_boxes = 1;
 
-    size_t sample_points[] = {
-        0,
-        (img->height - 1) * img->width,
-        (img->height - 1) * img->width + (img->width - 1),
-        (img->height / 2) * img->width + (img->width / 2),
-        (img->height / 4) * img->width + (img->width / 4),
-        (img->height / 4) * img->width + 3 * (img->width / 4),
-        3 * (img->height / 4) * img->width + (img->width / 4),
-        3 * (img->height / 4) * img->width + 3 * (img->width / 4)
-    };
+    for (size_t j = 0; j < samples_count && num_colors < PALETTE_SIZE; j++)
+    {
+        RGB new_color = samples[j];
+
+        if (is_color_too_similar(palette->colors, num_colors, new_color))
+            new_color = blend_colors(new_color, palette->colors[j], 0.5);
+
+        palette->colors[num_colors++] = new_color;
+    }
+}
+
+/*
+ * Early exit for solid and low entropy images.
+ *
+ * Grid sample of image is binned into 4 bit per channel cells, it stops
+ * as soon as more than LOW_ENTROPY_CELLS cells are occupied. Otherwise
+ * cells are sorted by luminance and palette takes their means at evenly
+ * spaced population quantiles, so few cells give luminance ramp of them.
+ *
+ * returns 1 if palette was built
+ */
+int low_entropy_palette(IMG *img, PALETTE *palette)
+{
+    const size_t total = (size_t)img->width * img->height;
+    if (total == 0)
+        return 0;
+
+    size_t step = (size_t)sqrt((double)total / LOW_ENTROPY_SAMPLE);
+    if (step < 1) step = 1;
+
+    typedef struct {
+        RGB color;
+        float lum;
+        unsigned long sum[3];
+        unsigned long count;
+    } Cell;
+
+    uint8_t slot[4096]; /* cell -> slot + 1, 0 if not occupied */
+    Cell cells[LOW_ENTROPY_CELLS];
+    size_t used = 0, sampled = 0;
 
-    for (size_t j = 0; j < sizeof(sample_points) / sizeof(sample_points[0]) && num_colors < PALETTE_SIZE; j++)
+    memset(slot, 0, sizeof(slot));
+
+    for (size_t y = step / 2; y < img->height; y += step)
     {
-        size_t i = sample_points[j];
-        if (i + 3 >= img->size) continue;
+        const uint8_t *row = img->pixels + y * img->width * 3;
+        for (size_t x = step / 2; x < img->width; x += step)
+        {
+            const uint8_t *px = row + x * 3;
+            unsigned cell = ((px[0] >> 4) << 8) | ((px[1] >> 4) << 4) | (px[2] >> 4);
 
-        RGB new_color = {img->pixels[i], img->pixels[i + 1], img->pixels[i + 2]};
+            if (slot[cell] == 0)
+            {
+                if (used == LOW_ENTROPY_CELLS)
+                    return 0;
+                memset(&cells[used], 0, sizeof(Cell));
+                slot[cell] = ++used;
+            }
 
-        if (!is_color_too_similar(palette.colors, num_colors, new_color))
-            new_color = palette.colors[num_colors++] = new_color;
-        else
-            new_color = blend_colors(new_color, palette.colors[j], 0.5);
+            Cell *c = &cells[slot[cell] - 1];
+            c->sum[0] += px[0];
+            c->sum[1] += px[1];
+            c->sum[2] += px[2];
+            c->count++;
+            sampled++;
+        }
+    }
+
+    if (used == 0)
+        return 0;
+
+    for (size_t i = 0; i < used; i++)
+    {
+        Cell *c = &cells[i];
+        c->color = (RGB){ c->sum[0] / c->count, c->sum[1] / c->count, c->sum[2] / c->count };
+        c->lum = calculate_luminance(c->color);
+    }
+
+    for (size_t i = 1; i < used; i++)
+        for (size_t k = i; k > 0 && cells[k].lum < cells[k - 1].lum; k--)
+        {
+            Cell temp = cells[k];
+            cells[k] = cells[k - 1];
+            cells[k - 1] = temp;
+        }
+
+    RGB colors[PALETTE_SIZE / 2];
+    for (size_t i = 0; i < PALETTE_SIZE / 2; i++)
+    {
+        /* middle of i-th quantile of population */
+        unsigned long target = (2 * i + 1) * sampled / PALETTE_SIZE;
+        unsigned long acc = 0;
+        size_t k = 0;
 
-        palette.colors[num_colors++] = new_color;
+        while (k + 1 < used && acc + cells[k].count <= target)
+            acc += cells[k++].count;
+
+        colors[i] = cells[k].color;
     }
 
     if (ARGS.DEBUG != 0)
-        log_c("\n---\n");
+        log_c("Low entropy image: [%zu] cells occupied, skipping quantization", used);
 
-    return palette;
+    palette_assemble(palette, colors, colors, colors, PALETTE_SIZE / 2);
+
+    return 1;
 }
 
-/* Writes palete to stdout */
-void print_palette(PALETTE pal)
+PALETTE gen_palette(IMG *img, const uint8_t *signature)
 {
-    if (ARGS.QUIET != 0)
-        return;
+    PALETTE palette = { .extended = NULL, .size = PALETTE_SIZE };
+    size_t total_pixels = img->size / 3;
+    RGB *all_colors = (RGB *)img->pixels;
 
-    for (size_t i=0; i<PALETTE_SIZE; i++)
+    size_t starts[PALETTE_SIZE / 2] = {0};
+    size_t ends[PALETTE_SIZE / 2] = {total_pixels};
+    size_t num_boxes = 1;
+
+    /* solid colors and simple gradients do not need full quantization */
+    if (low_entropy_palette(img, &palette))
     {
-        print_color(pal.colors[i]);
-        if (i+1 == PALETTE_SIZE/2) printf("\n");
+        if (ARGS.PYRAMID != 0 && ARGS.DEBUG != 0)
+            log_c("Pyramid: not used, image has low entropy");
+        if (ARGS.PALETTE_COLORS > PALETTE_SIZE)
+            gen_palette_extended(img, NULL, &palette);
+        return palette;
     }
-    printf("\n");
-}
 
-/* 
- * Write color palette to buffer, hex or rgb by setting up type
- */
-char *palette_color(PALETTE pal, unsigned c, enum COLOR_TYPES type)
-{
-    if (c > PALETTE_SIZE - 1)
-        return NULL;
+    uint8_t *weights = gen_weights(img);
 
-    char *hex_fmt = "%02x%02x%02x";
-    char *rgb_fmt = "%d, %d, %d";
-    char *buffer = (char*)malloc(64);
+    /* regions are sampled before median cut reorders pixels */
+    RGB samples[SAMPLE_REGIONS];
+    for (size_t j = 0; j < SAMPLE_REGIONS; j++)
+        samples[j] = region_color(img, weights, j);
 
-    switch (type) {
-    case HEX_t:
-        sprintf(buffer, hex_fmt, pal.colors[c].R, pal.colors[c].G, pal.colors[c].B);
-        break;
-    case RGB_t:
-        sprintf(buffer, rgb_fmt, pal.colors[c].R, pal.colors[c].G, pal.colors[c].B);
-        break;
-    case R_t:
-        sprintf(buffer, "%d", pal.colors[c].R);
-        break;
-    case G_t:
-        sprintf(buffer, "%d", pal.colors[c].G);
-        break;
-    case B_t:
-        sprintf(buffer, "%d", pal.colors[c].B);
-        break;
-    }
+    const HISTOGRAM_KERNEL_T *hk = get_histogram_kernel(ARGS.BINS_COUNT);
+    const unsigned bins = hk->bins;
 
-    return buffer;
-}
+    /* default bins fit on the stack, bigger ones go to the heap */
+    unsigned histogram_stack[BINS * BINS * BINS];
+    unsigned *histogram = histogram_stack;
 
-/* print gray-scale palettes */
-void print_palette_gray_scale_iter(IMG *img, size_t iter)
-{
-    if (img == NULL) return;
+    if (bins <= BINS)
+        memset(histogram_stack, 0, sizeof(histogram_stack));
+    else if ((histogram = calloc((size_t)bins * bins * bins, sizeof(unsigned))) == NULL)
+        err("Failed to allocate memory for histogram");
 
-    PALETTE pal;
+    /* seeded by similar cached image, coarse-to-fine if requested, full median cut otherwise */
+    RGB box_colors[PALETTE_SIZE / 2];
+    int precomputed = 0, pyramid = 0;
 
-    for (size_t i = 0; i < iter; i++)
+    if (signature != NULL && find_similar_palette(signature, box_colors))
     {
-        ARGS.GRAY_SCALE = (float)i == 0 ? 0 : (float)((float)i/iter);
-
-        sort_palette_by_luminance(&pal);
+        warm_box_colors(img, weights, box_colors, box_colors);
+        precomputed = 1;
 
-        printf("GRAYSCALE VALUE: %f\n", ARGS.GRAY_SCALE);
-        print_palette(pal);
+        if (ARGS.PYRAMID != 0 && ARGS.DEBUG != 0)
+            log_c("Pyramid: not used, palette is warm started");
     }
+    else if (ARGS.PYRAMID != 0)
+        precomputed = pyramid = pyramid_box_colors(img, weights, hk, histogram, box_colors);
 
-    ARGS.GRAY_SCALE = -1.f;
-}
+    if (!precomputed)
+        median_cut(all_colors, weights, starts, ends, &num_boxes, PALETTE_SIZE / 2);
 
-/* Load image file using stb, return IMG structure */
-IMG *img_load(char *filename)
-{
-    if (ARGS.IMAGE == NULL)
-        err("No image provided");
-    log_c("Loading image %s", ARGS.IMAGE);
+    /* pyramid filled histogram from its sampled pixels */
+    if (!pyramid && weights != NULL)
+        hk->weighted(img->pixels, weights, total_pixels, histogram);
+    else if (!pyramid)
+        hk->kernel(img->pixels, total_pixels, histogram);
 
-    int width, height;
-    int numberOfChannels;
-    int forcedNumberOfChannels = 3;
+    RGB bin_colors[PALETTE_SIZE / 2];
+    histogram_top_bins(histogram, hk, bin_colors);
 
-    uint8_t *imageData = stbi_load(filename, &width, &height, &numberOfChannels, forcedNumberOfChannels);
+    if (histogram != histogram_stack)
+        free(histogram);
 
-    if (imageData == 0) err("Error while loading the file: %s", filename);
+    for (size_t i = 0; !precomputed && i < PALETTE_SIZE / 2; i++)
+        box_colors[i] = average_color(img, weights, starts[i], ends[i]);
 
-    IMG *img = malloc(sizeof(IMG));
+    palette_assemble(&palette, box_colors, bin_colors, samples, SAMPLE_REGIONS);
 
-    img->size = width * height * forcedNumberOfChannels;
-    img->pixels = imageData;
+    if (ARGS.DEBUG != 0)
+        log_c("\n---\n");
 
-    log_c("Loaded!");
-    return img;
-}
+    if (ARGS.PALETTE_COLORS > PALETTE_SIZE)
+        gen_palette_extended(img, weights, &palette);
 
-/* free all allocated stuff in IMG */
-void img_free(IMG *img)
-{
-    stbi_image_free(img->pixels);
-    free(img);
+    free(weights);
+
+    return palette;
 }
 
-/* 
- * overides default terminal color variables from PALETTE
- * This works thanks to this (and chatgpt):
- * - https://github.com/dylanaraps/paleta
- * - https://github.com/alacritty/alacritty/issues/656
- * - http://pod.tst.eu/http://cvs.schmorp.de/rxvt-unicode/doc/rxvt.7.pod#XTerm_Operating_System_Commands
- *
- * Manipulate special colors.
- *   10 = foreground,
- *   11 = background,
- *   12 = cursor foreground,
- *   13 = mouse foreground,
- *   708 = terminal border background
- *
- *   \033]{index};{color}\007
- */
-void set_term_colors(PALETTE pal)
+/* index of nearest color, best and second best squared distances are set */
+size_t nearest_color(const RGB *colors, size_t count, RGB c, float *best, float *second)
 {
-    size_t succ = 0;
-    if (ARGS.SKIP_TERM_COLORS == 0)
-    {
-        char buffer[1024];
-        size_t offset = 0;
+    size_t nearest = 0;
+    *best = *second = INFINITY;
 
-        const char *fmt_s = "\033]%d;#%s\033\\";
-        const char *fmt_p = "\033]4;%d;#%s\033\\";
+    for (size_t k = 0; k < count; k++)
+    {
+        float dr = (float)c.R - colors[k].R;
+        float dg = (float)c.G - colors[k].G;
+        float db = (float)c.B - colors[k].B;
+        float d = dr * dr + dg * dg + db * db;
 
-        /* Create the sequences */
-        for (unsigned i = 0; i < PALETTE_SIZE; i++)
+        if (d < *best)
         {
-            const char *color = palette_color(pal, i, HEX_t);
-            offset += snprintf(buffer + offset, sizeof(buffer) - offset, fmt_p, i, color);
+            *second = *best;
+            *best = d;
+            nearest = k;
         }
-        const char *bg_color     = palette_color(pal, 0,  HEX_t);
-        const char *fg_color     = palette_color(pal, PALETTE_SIZE - 1, HEX_t);
-        const char *cursor_color = palette_color(pal, PALETTE_SIZE - 1, HEX_t);
-        const char *border_color = palette_color(pal, PALETTE_SIZE - 1, HEX_t);
+        else if (d < *second)
+            *second = d;
+    }
 
-        fg_color = fg_color ? fg_color : "FFFFFF";             /* Default to white */
-        bg_color = bg_color ? bg_color : "000000";             /* Default to black */
-        cursor_color = cursor_color ? cursor_color : "FFFFFF"; /* Default to white */
-        border_color = border_color ? border_color : "000000"; /* Default to black */
+    return nearest;
+}
 
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset, fmt_s, 10, fg_color);
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset, fmt_s, 11, bg_color);
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset, fmt_s, 12, cursor_color);
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset, fmt_s, 708, border_color);
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
 
-        /* Broadcast the sequences to all terminal devices */
-        glob_t globbuf;
-        if (glob("/dev/pts/*", GLOB_NOSORT, NULL, &globbuf) == 0)
-        {
-            for (size_t i = 0; i < globbuf.gl_pathc; i++)
-            {
-                FILE *f = fopen(globbuf.gl_pathv[i], "w");
-                if (f)
-                {
+static inline uint64_t _rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t _xxh_round(uint64_t acc, uint64_t input)
+{
+    return _rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t _xxh_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint32_t _xxh_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+/* XXH64 of given bytes, fast enough to hash wallpaper on every cache miss */
+uint64_t hash_bytes(const uint8_t *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data, *end = data + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v[4] = { seed + XXH_P1 + XXH_P2, seed + XXH_P2, seed, seed - XXH_P1 };
+
+        for (; p + 32 <= end; p += 32)
+            for (int i = 0; i < 4; i++)
+                v[i] = _xxh_round(v[i], _xxh_read64(p + i * 8));
+
+        h = _rotl64(v[0], 1) + _rotl64(v[1], 7) + _rotl64(v[2], 12) + _rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = (h ^ _xxh_round(0, v[i])) * XXH_P1 + XXH_P4;
+    }
+    else
+        h = seed + XXH_P5;
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+        h = _rotl64(h ^ _xxh_round(0, _xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end)
+    {
+        h = _rotl64(h ^ (uint64_t)_xxh_read32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = _rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* hash of file contents, file is mapped instead of read */
+int file_hash(const char *filepath, uint64_t *hash)
+{
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        *hash = hash_bytes(NULL, 0, 0);
+        return 1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    *hash = hash_bytes(data, st.st_size, 0);
+    munmap(data, st.st_size);
+
+    return 1;
+}
+
+/*
+ * Cache key of image: hash of its contents as 16 hex digits, so moved
+ * or renamed wallpapers still hit and edited ones don't get stale palettes.
+ *
+ * Files seen before are not hashed again, OUTPUT/cache/ids/ holds one
+ * symlink per image path, named after hash of the path and pointing to
+ * "<key> <dev>-<inode>-<size>-<mtime>", so known file costs one stat()
+ * and one readlink(). Changed file gets its link replaced, not another one.
+ *
+ * key needs room for 17 bytes, returns 0 if file can't be read
+ */
+int cache_key(const char *filepath, char *key)
+{
+    struct stat st;
+    if (stat(filepath, &st) != 0)
+        return 0;
+
+    char resolved[PATH_MAX];
+    const char *path = realpath(filepath, resolved) ? resolved : filepath;
+
+    char id[96], target[128];
+    snprintf(id, sizeof(id), "%llx-%llx-%llx-%llx.%09ld",
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size, (unsigned long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/ids/") + 16 + 16;
+    char *link_path = malloc(len);
+    if (link_path == NULL)
+        return 0;
+
+    snprintf(link_path, len, "%s/cache/ids/%016llx", ARGS.OUTPUT,
+             (unsigned long long)hash_bytes((const uint8_t *)path, strlen(path), 0));
+
+    ssize_t n = readlink(link_path, target, sizeof(target) - 1);
+    if (n >= 0)
+        target[n] = '\0';
+
+    if (n > 17 && target[16] == ' ' && strcmp(target + 17, id) == 0)
+    {
+        memcpy(key, target, 16);
+        key[16] = '\0';
+        free(link_path);
+        return 1;
+    }
+
+    uint64_t h;
+    if (!file_hash(filepath, &h))
+    {
+        free(link_path);
+        return 0;
+    }
+    snprintf(key, 17, "%016llx", (unsigned long long)h);
+
+    /* replaced at once, concurrent runs see old link or new one */
+    char *tmp_path = malloc(len + 16);
+    snprintf(target, sizeof(target), "%s %s", key, id);
+    if (tmp_path != NULL)
+        sprintf(tmp_path, "%s.%d", link_path, (int)getpid());
+
+    if (tmp_path == NULL || symlink(target, tmp_path) != 0 || rename(tmp_path, link_path) != 0)
+    {
+        if (tmp_path != NULL)
+            unlink(tmp_path);
+        if (ARGS.DEBUG != 0)
+            log_c("Failed to remember cache key of %s", filepath);
+    }
+
+    free(tmp_path);
+    free(link_path);
+    return 1;
+}
+
+/* creates cache dirs once, before anything is looked up or stored */
+void cache_init(void)
+{
+    if (ARGS.NO_CACHE != 0 || ARGS.OUTPUT == NULL)
+        return;
+
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/ids/") + 1;
+    char *dir = malloc(len);
+    if (dir == NULL)
+        return;
+
+    check_output_dir(ARGS.OUTPUT);
+    snprintf(dir, len, "%s/cache/", ARGS.OUTPUT);
+    check_output_dir(dir);
+    snprintf(dir, len, "%s/cache/ids/", ARGS.OUTPUT);
+    check_output_dir(dir);
+
+    free(dir);
+}
+
+/* path of cache entry for given image: OUTPUT/cache/<key><ext> */
+char *cache_entry_path(const char *filepath, const char *ext)
+{
+    char key[17];
+    if (!cache_key(filepath, key))
+        return NULL;
+
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/") + strlen(key) + strlen(ext) + 1;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/cache/%s%s", ARGS.OUTPUT, key, ext);
+
+    return path;
+}
+
+/* quantizer parameters palette depends on, written to text cache export */
+void quantizer_params(char *buf, size_t size, enum QUANTIZER_BACKEND backend)
+{
+    static const char *weighting[] = { "none", "center", "edge", "saliency" };
+    static const char *backends[] = { "median", "pyramid", "stream", "histogram" };
+
+    snprintf(buf, size, "bins:%u weighting:%s backend:%s",
+             get_histogram_kernel(ARGS.BINS_COUNT)->bins, weighting[ARGS.WEIGHTING], backends[backend]);
+}
+
+/* hash of header before checksum, cell index and counts */
+static uint64_t sparse_histogram_checksum(const SPARSE_HISTOGRAM *h)
+{
+    uint64_t c = hash_bytes((const uint8_t *)&h->header, offsetof(SPARSE_HISTOGRAM_HEADER, checksum), 0);
+    c = hash_bytes((const uint8_t *)h->index, h->header.cells * sizeof(uint16_t), c);
+    return hash_bytes((const uint8_t *)h->counts, h->header.cells * sizeof(uint32_t), c);
+}
+
+/* counts occupied 15-bit cells of image and writes them next to cached palette */
+void sparse_histogram_write(const char *filepath, IMG *img, const uint8_t *signature)
+{
+    if (ARGS.NO_CACHE != 0)
+        return;
+
+    uint32_t *dense = calloc(SPARSE_HISTOGRAM_CELLS, sizeof(uint32_t));
+    if (dense == NULL)
+        err("Failed to allocate memory for histogram");
+
+    const size_t total = img->size / 3;
+    const unsigned shift = 8 - SPARSE_HISTOGRAM_BITS;
+    const uint8_t *px = img->pixels;
+
+    for (size_t i = 0; i < total; i++, px += 3)
+        dense[((px[0] >> shift) << 10) | ((px[1] >> shift) << 5) | (px[2] >> shift)]++;
+
+    /* padding is zeroed too, checksum covers it */
+    SPARSE_HISTOGRAM h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.header.magic, SPARSE_HISTOGRAM_MAGIC, 4);
+    h.header.width = img->width;
+    h.header.height = img->height;
+    memcpy(h.header.signature, signature, SIGNATURE_SIZE);
+
+    /* histogram can't tell where colors are, regions are kept as they are */
+    for (size_t j = 0; j < SAMPLE_REGIONS; j++)
+        h.header.samples[j] = region_color(img, NULL, j);
+
+    for (size_t c = 0; c < SPARSE_HISTOGRAM_CELLS; c++)
+        h.header.cells += dense[c] != 0;
+
+    h.index = malloc(h.header.cells * sizeof(uint16_t));
+    h.counts = malloc(h.header.cells * sizeof(uint32_t));
+    if (h.index == NULL || h.counts == NULL)
+        err("Failed to allocate memory for histogram");
+
+    for (size_t c = 0, n = 0; c < SPARSE_HISTOGRAM_CELLS; c++)
+    {
+        if (dense[c] == 0)
+            continue;
+        h.index[n] = (uint16_t)c;
+        h.counts[n++] = dense[c];
+    }
+    free(dense);
+    h.header.checksum = sparse_histogram_checksum(&h);
+
+    /* written aside and renamed, readers never see it half written */
+    char *path = cache_entry_path(filepath, ".hist");
+    char *tmp_path = path ? malloc(strlen(path) + 16) : NULL;
+    if (tmp_path != NULL)
+        sprintf(tmp_path, "%s.%d", path, (int)getpid());
+
+    FILE *f = tmp_path ? fopen(tmp_path, "wb") : NULL;
+    int ok = f != NULL
+        && fwrite(&h.header, sizeof(h.header), 1, f) == 1
+        && fwrite(h.index, sizeof(uint16_t), h.header.cells, f) == h.header.cells
+        && fwrite(h.counts, sizeof(uint32_t), h.header.cells, f) == h.header.cells;
+
+    if (f != NULL && fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmp_path, path) != 0)
+        ok = 0;
+
+    if (!ok)
+    {
+        warn("Failed to write histogram: %s", path ? path : filepath);
+        if (tmp_path != NULL)
+            unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(path);
+    sparse_histogram_free(&h);
+}
+
+/*
+ * loads histogram persisted for image, returns 0 if there is none
+ * or requested weighting needs pixel positions
+ */
+int sparse_histogram_load(const char *filepath, SPARSE_HISTOGRAM *h)
+{
+    if (ARGS.NO_CACHE != 0 || ARGS.WEIGHTING != WEIGHT_NONE)
+        return 0;
+
+    char *path = cache_entry_path(filepath, ".hist");
+    FILE *f = path ? fopen(path, "rb") : NULL;
+    free(path);
+
+    if (f == NULL)
+        return 0;
+
+    memset(h, 0, sizeof(*h));
+    int ok = fread(&h->header, sizeof(h->header), 1, f) == 1
+        && memcmp(h->header.magic, SPARSE_HISTOGRAM_MAGIC, 4) == 0
+        && h->header.cells <= SPARSE_HISTOGRAM_CELLS;
+
+    if (ok)
+    {
+        h->index = malloc(h->header.cells * sizeof(uint16_t) + 1);
+        h->counts = malloc(h->header.cells * sizeof(uint32_t) + 1);
+        ok = h->index != NULL && h->counts != NULL
+            && fread(h->index, sizeof(uint16_t), h->header.cells, f) == h->header.cells
+            && fread(h->counts, sizeof(uint32_t), h->header.cells, f) == h->header.cells;
+    }
+    fclose(f);
+
+    ok = ok && h->header.checksum == sparse_histogram_checksum(h);
+    for (uint32_t i = 0; ok && i < h->header.cells; i++)
+        ok = h->index[i] < SPARSE_HISTOGRAM_CELLS;
+
+    if (!ok)
+    {
+        sparse_histogram_free(h);
+        return 0;
+    }
+
+    if (ARGS.DEBUG != 0)
+        log_c("Using cached histogram (%u cells), image is not decoded", h->header.cells);
+
+    return 1;
+}
+
+void sparse_histogram_free(SPARSE_HISTOGRAM *h)
+{
+    free(h->index);
+    free(h->counts);
+    h->index = NULL;
+    h->counts = NULL;
+}
+
+typedef struct { RGB color; uint32_t count; } SPARSE_CELL;
+static int _sparse_cell_channel;
+
+int _compare_sparse_cell_qsort(const void *a, const void *b)
+{
+    const uint8_t *ca = &((const SPARSE_CELL *)a)->color.R;
+    const uint8_t *cb = &((const SPARSE_CELL *)b)->color.R;
+    return (int)ca[_sparse_cell_channel] - (int)cb[_sparse_cell_channel];
+}
+
+/*
+ * Median cut over histogram cells, boxes are split at count-weighted median
+ * of their widest channel. Returns number of boxes, it's less than target
+ * only if there are not enough cells.
+ */
+size_t sparse_histogram_boxes(const SPARSE_HISTOGRAM *h, size_t target, RGB *out)
+{
+    const size_t n = h->header.cells;
+    if (n == 0 || target == 0)
+        return 0;
+
+    SPARSE_CELL *cells = malloc(n * sizeof(SPARSE_CELL));
+    size_t *starts = calloc(target, sizeof(size_t));
+    size_t *ends = calloc(target, sizeof(size_t));
+    if (cells == NULL || starts == NULL || ends == NULL)
+        err("Failed to allocate memory for histogram boxes");
+
+    const unsigned shift = 8 - SPARSE_HISTOGRAM_BITS, half = 1 << (shift - 1);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint16_t c = h->index[i];
+        cells[i].color = (RGB){ ((c >> 10) & 31) << shift | half, ((c >> 5) & 31) << shift | half, (c & 31) << shift | half };
+        cells[i].count = h->counts[i];
+    }
+
+    size_t boxes = 1;
+    ends[0] = n;
+
+    while (boxes < target)
+    {
+        int best_range = 0, best_channel = 0;
+        size_t best = 0;
+
+        for (size_t b = 0; b < boxes; b++)
+        {
+            uint8_t mins[3] = {255, 255, 255}, maxs[3] = {0};
+            for (size_t i = starts[b]; i < ends[b]; i++)
+            {
+                const uint8_t *c = &cells[i].color.R;
+                for (int ch = 0; ch < 3; ch++)
+                {
+                    if (c[ch] < mins[ch]) mins[ch] = c[ch];
+                    if (c[ch] > maxs[ch]) maxs[ch] = c[ch];
+                }
+            }
+
+            for (int ch = 0; ch < 3; ch++)
+            {
+                if (maxs[ch] - mins[ch] > best_range)
+                {
+                    best_range = maxs[ch] - mins[ch];
+                    best_channel = ch;
+                    best = b;
+                }
+            }
+        }
+
+        /* every box is a single cell */
+        if (best_range == 0)
+            break;
+
+        _sparse_cell_channel = best_channel;
+        qsort(cells + starts[best], ends[best] - starts[best], sizeof(SPARSE_CELL), _compare_sparse_cell_qsort);
+
+        uint64_t total = 0, acc = 0;
+        for (size_t i = starts[best]; i < ends[best]; i++)
+            total += cells[i].count;
+
+        size_t split = starts[best] + 1;
+        for (size_t i = starts[best]; i < ends[best] - 1; i++)
+        {
+            acc += cells[i].count;
+            split = i + 1;
+            if (acc * 2 >= total)
+                break;
+        }
+
+        starts[boxes] = split;
+        ends[boxes] = ends[best];
+        ends[best] = split;
+        boxes++;
+    }
+
+    for (size_t b = 0; b < boxes; b++)
+    {
+        uint64_t sum[3] = {0}, count = 0;
+        for (size_t i = starts[b]; i < ends[b]; i++)
+        {
+            sum[0] += (uint64_t)cells[i].color.R * cells[i].count;
+            sum[1] += (uint64_t)cells[i].color.G * cells[i].count;
+            sum[2] += (uint64_t)cells[i].color.B * cells[i].count;
+            count += cells[i].count;
+        }
+        out[b] = (RGB){ sum[0] / count, sum[1] / count, sum[2] / count };
+    }
+
+    free(cells);
+    free(starts);
+    free(ends);
+
+    return boxes;
+}
+
+/*
+ * Same palette as gen_palette() without pixels: box colors from histogram
+ * median cut, bins are merged histogram cells, regions are persisted.
+ */
+PALETTE gen_palette_histogram(const SPARSE_HISTOGRAM *h)
+{
+    PALETTE palette = { .extended = NULL, .size = PALETTE_SIZE };
+
+    RGB box_colors[PALETTE_SIZE / 2];
+    size_t boxes = sparse_histogram_boxes(h, PALETTE_SIZE / 2, box_colors);
+    for (size_t i = boxes; i < PALETTE_SIZE / 2; i++)
+        box_colors[i] = boxes ? box_colors[i % boxes] : (RGB){0, 0, 0};
+
+    const HISTOGRAM_KERNEL_T *hk = get_histogram_kernel(ARGS.BINS_COUNT);
+    const unsigned bins = hk->bins, drop = SPARSE_HISTOGRAM_BITS - hk->bits;
+
+    unsigned *histogram = calloc((size_t)bins * bins * bins, sizeof(unsigned));
+    if (histogram == NULL)
+        err("Failed to allocate memory for histogram");
+
+    for (size_t i = 0; i < h->header.cells; i++)
+    {
+        uint16_t c = h->index[i];
+        unsigned r = ((c >> 10) & 31) >> drop, g = ((c >> 5) & 31) >> drop, b = (c & 31) >> drop;
+        histogram[(r << (2 * hk->bits)) | (g << hk->bits) | b] += h->counts[i];
+    }
+
+    RGB bin_colors[PALETTE_SIZE / 2];
+    histogram_top_bins(histogram, hk, bin_colors);
+    free(histogram);
+
+    palette_assemble(&palette, box_colors, bin_colors, h->header.samples, SAMPLE_REGIONS);
+
+    if (ARGS.PALETTE_COLORS > PALETTE_SIZE)
+    {
+        size_t target = ARGS.PALETTE_COLORS - PALETTE_SIZE;
+        palette_alloc_extended(&palette, ARGS.PALETTE_COLORS);
+
+        boxes = sparse_histogram_boxes(h, target, palette.extended);
+        for (size_t i = boxes; i < target; i++)
+            palette.extended[i] = boxes ? palette.extended[i % boxes] : (RGB){0, 0, 0};
+
+        qsort(palette.extended, target, sizeof(RGB), _compare_luminance_qsort);
+    }
+
+    return palette;
+}
+
+/* 4x4 thumbnail of the image, every cell is mean of a sparse grid of its pixels */
+void img_signature(IMG *img, uint8_t *signature)
+{
+    const size_t w = img->width, h = img->height;
+    const size_t g = SIGNATURE_GRID;
+
+    for (size_t cy = 0; cy < g; cy++)
+    {
+        for (size_t cx = 0; cx < g; cx++)
+        {
+            size_t x0 = cx * w / g, x1 = (cx + 1) * w / g;
+            size_t y0 = cy * h / g, y1 = (cy + 1) * h / g;
+            size_t sx = (x1 - x0) / 16 + 1, sy = (y1 - y0) / 16 + 1;
+
+            unsigned long sum[3] = {0}, count = 0;
+            for (size_t y = y0; y < y1; y += sy)
+            {
+                const uint8_t *row = img->pixels + y * w * 3;
+                for (size_t x = x0; x < x1; x += sx, count++)
+                {
+                    sum[0] += row[x * 3];
+                    sum[1] += row[x * 3 + 1];
+                    sum[2] += row[x * 3 + 2];
+                }
+            }
+
+            uint8_t *cell = signature + (cy * g + cx) * 3;
+            for (int c = 0; c < 3; c++)
+                cell[c] = count ? (uint8_t)(sum[c] / count) : 0;
+        }
+    }
+}
+
+/* mean absolute channel difference of two signatures */
+float signature_distance(const uint8_t *a, const uint8_t *b)
+{
+    unsigned sum = 0;
+    for (size_t i = 0; i < SIGNATURE_SIZE; i++)
+        sum += abs((int)a[i] - (int)b[i]);
+    return (float)sum / SIGNATURE_SIZE;
+}
+
+typedef struct
+{
+    const uint8_t *signature;
+    float best;
+    uint64_t key;
+    int found;
+} SIMILAR_SEARCH;
+
+static int similar_palette_callback(uint64_t key, const uint8_t *signature, void *ctx)
+{
+    SIMILAR_SEARCH *search = ctx;
+
+    float d = signature_distance(search->signature, signature);
+    if (d < search->best)
+    {
+        search->best = d;
+        search->key = key;
+        search->found = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Looks through signatures of cached palettes for the nearest one,
+ * seed gets box colors its palette was blended from.
+ *
+ * returns 0 if nothing is close enough
+ */
+int find_similar_palette(const uint8_t *signature, RGB *seed)
+{
+    if (ARGS.NO_CACHE != 0 || ARGS.NO_WARM_START != 0 || ARGS.OUTPUT == NULL)
+        return 0;
+
+    SIMILAR_SEARCH search = { .signature = signature, .best = SIGNATURE_THRESHOLD, .found = 0 };
+    cache_db_scan_signatures(similar_palette_callback, &search);
+
+    PALETTE_RECORD r;
+    if (!search.found || !cache_db_lookup(search.key, &r) || !r.has_boxes)
+        return 0;
+
+    memcpy(seed, r.boxes, sizeof(r.boxes));
+
+    if (ARGS.DEBUG != 0)
+        log_c("Warm start from cached palette %016llx (signature distance %.1f)", (unsigned long long)search.key, search.best);
+
+    return 1;
+}
+
+/*
+ * Few k-means iterations on a sparse grid of pixels, starting from seed colors,
+ * replaces median cut when palette of similar image is already known.
+ * Seed colors nothing was assigned to are kept.
+ */
+void warm_box_colors(IMG *img, const uint8_t *weights, const RGB *seed, RGB *out)
+{
+    const size_t k = PALETTE_SIZE / 2;
+    const size_t total = img->size / 3;
+
+    size_t step = (size_t)sqrt((double)total / WARM_START_SAMPLE);
+    if (step < 1) step = 1;
+
+    RGB centroids[PALETTE_SIZE / 2];
+    memcpy(centroids, seed, sizeof(centroids));
+
+    for (int it = 0; it < WARM_START_ITERATIONS; it++)
+    {
+        double sum[PALETTE_SIZE / 2][4] = {{0}};
+
+        for (size_t y = step / 2; y < img->height; y += step)
+        {
+            for (size_t x = step / 2; x < img->width; x += step)
+            {
+                size_t i = y * img->width + x;
+                const uint8_t *px = img->pixels + i * 3;
+                RGB c = { px[0], px[1], px[2] };
+                unsigned w = weights ? weights[i] : 1;
+
+                float best, second;
+                size_t n = nearest_color(centroids, k, c, &best, &second);
+                sum[n][0] += (double)c.R * w;
+                sum[n][1] += (double)c.G * w;
+                sum[n][2] += (double)c.B * w;
+                sum[n][3] += w;
+            }
+        }
+
+        for (size_t n = 0; n < k; n++)
+        {
+            if (sum[n][3] == 0)
+                continue;
+            centroids[n].R = (uint8_t)(sum[n][0] / sum[n][3]);
+            centroids[n].G = (uint8_t)(sum[n][1] / sum[n][3]);
+            centroids[n].B = (uint8_t)(sum[n][2] / sum[n][3]);
+        }
+    }
+
+    memcpy(out, centroids, sizeof(centroids));
+}
+
+/*
+ * Coarse-to-fine box colors.
+ *
+ * Image is reduced PYRAMID_FACTOR times per dimension from pixels
+ * PYRAMID_STEP apart, so only 1/4 of them is read, and histogram is
+ * counted from the same pixels. Median cut runs on reduced image.
+ * Then every cell is assigned to nearest coarse color: unambiguous cells
+ * contribute their mean for all their pixels, ambiguous ones (close to
+ * decision boundary or not uniform) are assigned pixel by pixel at
+ * full resolution. Box colors are means of what was assigned to them.
+ *
+ * returns 0 if image is too small to be reduced, histogram is untouched then
+ */
+int pyramid_box_colors(IMG *img, const uint8_t *weights, const HISTOGRAM_KERNEL_T *hk, unsigned *histogram, RGB *out)
+{
+    const size_t f = PYRAMID_FACTOR;
+    const size_t w = img->width, h = img->height;
+
+    if (w < f * 4 || h < f * 4)
+    {
+        if (ARGS.DEBUG != 0)
+            log_c("Pyramid: not used, image is too small");
+        return 0;
+    }
+
+    const size_t rw = (w + f - 1) / f, rh = (h + f - 1) / f;
+    const size_t cells = rw * rh;
+
+    unsigned long *sums = calloc(cells * 4, sizeof(unsigned long));
+    uint8_t *spread = calloc(cells, 1);
+    uint8_t *mins = malloc(rw * 3), *maxs = malloc(rw * 3);
+    RGB *coarse = malloc(cells * sizeof(RGB));
+    uint8_t *coarse_weights = weights ? malloc(cells) : NULL;
+
+    if (!sums || !spread || !mins || !maxs || !coarse || (weights && !coarse_weights))
+        err("Failed to allocate memory for image pyramid");
+
+    /* reduce from sampled pixels, cell sums are weighted, spread is widest channel range */
+    size_t sampled = 0;
+    for (size_t cy = 0; cy < rh; cy++)
+    {
+        memset(mins, 255, rw * 3);
+        memset(maxs, 0, rw * 3);
+
+        for (size_t y = cy * f; y < (cy + 1) * f && y < h; y += PYRAMID_STEP)
+        {
+            for (size_t x = 0; x < w; x += PYRAMID_STEP)
+            {
+                const uint8_t *px = img->pixels + (y * w + x) * 3;
+                size_t cx = x / f;
+                unsigned long *sum = sums + (cy * rw + cx) * 4;
+                unsigned wt = weights ? weights[y * w + x] : 1;
+
+                sum[0] += px[0] * wt;
+                sum[1] += px[1] * wt;
+                sum[2] += px[2] * wt;
+                sum[3] += wt;
+                sampled++;
+
+                histogram[HISTOGRAM_BIN(px, hk->bits)] += wt;
+
+                for (size_t c = 0; c < 3; c++)
+                {
+                    if (px[c] < mins[cx * 3 + c]) mins[cx * 3 + c] = px[c];
+                    if (px[c] > maxs[cx * 3 + c]) maxs[cx * 3 + c] = px[c];
+                }
+            }
+        }
+
+        for (size_t cx = 0; cx < rw; cx++)
+        {
+            size_t i = cy * rw + cx;
+            unsigned long n = sums[i * 4 + 3] ? sums[i * 4 + 3] : 1;
+
+            coarse[i] = (RGB){ sums[i * 4] / n, sums[i * 4 + 1] / n, sums[i * 4 + 2] / n };
+            if (coarse_weights)
+                coarse_weights[i] = n > 255 ? 255 : n;
+
+            for (size_t c = 0; c < 3; c++)
+            {
+                uint8_t range = maxs[cx * 3 + c] - mins[cx * 3 + c];
+                if (range > spread[i]) spread[i] = range;
+            }
+        }
+    }
+
+    /* coarse palette, median cut reorders pixels so it works on a copy */
+    RGB *ordered = malloc(cells * sizeof(RGB));
+    uint8_t *ordered_weights = coarse_weights ? malloc(cells) : NULL;
+    if (!ordered || (coarse_weights && !ordered_weights))
+        err("Failed to allocate memory for image pyramid");
+
+    memcpy(ordered, coarse, cells * sizeof(RGB));
+    if (ordered_weights)
+        memcpy(ordered_weights, coarse_weights, cells);
+
+    size_t starts[PALETTE_SIZE / 2] = {0};
+    size_t ends[PALETTE_SIZE / 2] = {cells};
+    size_t num_boxes = 1;
+
+    median_cut(ordered, ordered_weights, starts, ends, &num_boxes, PALETTE_SIZE / 2);
+
+    IMG level = { .pixels = (uint8_t *)ordered, .size = cells * 3, .width = rw, .height = rh };
+    RGB centroids[PALETTE_SIZE / 2];
+    for (size_t k = 0; k < PALETTE_SIZE / 2; k++)
+        centroids[k] = average_color(&level, ordered_weights, starts[k], ends[k]);
+
+    /* refine */
+    unsigned long acc[PALETTE_SIZE / 2][4] = {{0}};
+    size_t refined = 0;
+
+    for (size_t cy = 0; cy < rh; cy++)
+    {
+        for (size_t cx = 0; cx < rw; cx++)
+        {
+            size_t i = cy * rw + cx;
+            float best, second;
+            size_t k = nearest_color(centroids, PALETTE_SIZE / 2, coarse[i], &best, &second);
+
+            if (spread[i] <= PYRAMID_SPREAD && sqrtf(second) - sqrtf(best) >= PYRAMID_MARGIN)
+            {
+                /* sampled sums stand for all pixels of the cell */
+                size_t cw = (cx + 1) * f < w ? f : w - cx * f;
+                size_t ch = (cy + 1) * f < h ? f : h - cy * f;
+                size_t cs = ((cw + PYRAMID_STEP - 1) / PYRAMID_STEP) * ((ch + PYRAMID_STEP - 1) / PYRAMID_STEP);
+                for (size_t c = 0; c < 4; c++)
+                    acc[k][c] += sums[i * 4 + c] * (cw * ch) / cs;
+                continue;
+            }
+
+            for (size_t y = cy * f; y < (cy + 1) * f && y < h; y++)
+            {
+                for (size_t x = cx * f; x < (cx + 1) * f && x < w; x++)
+                {
+                    const uint8_t *px = img->pixels + (y * w + x) * 3;
+                    unsigned wt = weights ? weights[y * w + x] : 1;
+
+                    k = nearest_color(centroids, PALETTE_SIZE / 2, (RGB){ px[0], px[1], px[2] }, &best, &second);
+                    acc[k][0] += px[0] * wt;
+                    acc[k][1] += px[1] * wt;
+                    acc[k][2] += px[2] * wt;
+                    acc[k][3] += wt;
+                    refined++;
+                }
+            }
+        }
+    }
+
+    for (size_t k = 0; k < PALETTE_SIZE / 2; k++)
+    {
+        unsigned long n = acc[k][3];
+        out[k] = n ? (RGB){ acc[k][0] / n, acc[k][1] / n, acc[k][2] / n } : centroids[k];
+    }
+
+    if (ARGS.DEBUG != 0)
+        log_c("Pyramid: sampled [%zu] and refined [%zu/%zu] pixels (%.2f%%), read %.2f%% of image",
+              sampled, refined, w * h, 100.0 * refined / (w * h), 100.0 * (sampled + refined) / (w * h));
+
+    free(sums);
+    free(spread);
+    free(mins);
+    free(maxs);
+    free(coarse);
+    free(coarse_weights);
+    free(ordered);
+    free(ordered_weights);
+
+    return 1;
+}
+
+/* start online quantizer, there are no centroids until first pixels arrive */
+void oq_init(ONLINE_QUANTIZER *q, unsigned width, unsigned height)
+{
+    memset(q, 0, sizeof(*q));
+
+    q->hk = get_histogram_kernel(ARGS.BINS_COUNT);
+    q->histogram = calloc((size_t)q->hk->bins * q->hk->bins * q->hk->bins, sizeof(unsigned));
+    if (q->histogram == NULL)
+        err("Failed to allocate memory for histogram");
+
+    for (size_t j = 0; j < SAMPLE_REGIONS; j++)
+        sample_region_rect(width, height, j, q->regions[j]);
+
+    q->width = width;
+    q->height = height;
+}
+
+/*
+ * feed [count] rows to quantizer: nearest centroid moves towards pixel
+ * by 1/n (running mean of its members), pixel far from all of them
+ * spawns new centroid while there is room. histogram and sample
+ * regions are accumulated as well
+ */
+void oq_update(ONLINE_QUANTIZER *q, const uint8_t *rows, size_t count)
+{
+    const size_t w = q->width;
+
+    q->hk->kernel(rows, w * count, q->histogram);
+
+    for (size_t y = 0; y < count; y++, q->row++)
+    {
+        const uint8_t *row = rows + y * w * 3;
+
+        for (size_t j = 0; j < SAMPLE_REGIONS; j++)
+        {
+            const size_t *rect = q->regions[j];
+            if (q->row < rect[2] || q->row >= rect[3])
+                continue;
+
+            for (size_t x = rect[0]; x < rect[1]; x++)
+            {
+                q->region_sums[j][0] += row[x * 3];
+                q->region_sums[j][1] += row[x * 3 + 1];
+                q->region_sums[j][2] += row[x * 3 + 2];
+            }
+            q->region_sums[j][3] += rect[1] - rect[0];
+        }
+
+        for (size_t x = 0; x < w; x++)
+        {
+            const float r = row[x * 3], g = row[x * 3 + 1], b = row[x * 3 + 2];
+
+            size_t nearest = 0;
+            float best = INFINITY;
+            for (size_t k = 0; k < q->used; k++)
+            {
+                float dr = r - q->centroids[k][0];
+                float dg = g - q->centroids[k][1];
+                float db = b - q->centroids[k][2];
+                float d = dr * dr + dg * dg + db * db;
+                if (d < best)
+                {
+                    best = d;
+                    nearest = k;
+                }
+            }
+
+            if (best > STREAM_SPAWN_DISTANCE && q->used < PALETTE_SIZE / 2)
+            {
+                nearest = q->used++;
+                q->centroids[nearest][0] = r;
+                q->centroids[nearest][1] = g;
+                q->centroids[nearest][2] = b;
+            }
+
+            float *c = q->centroids[nearest];
+            const float rate = 1.0f / ++q->counts[nearest];
+            c[0] += (r - c[0]) * rate;
+            c[1] += (g - c[1]) * rate;
+            c[2] += (b - c[2]) * rate;
+        }
+    }
+}
+
+/* row_callback_t for img_stream_rows, starts quantizer on first block */
+void oq_rows_callback(void *ctx, unsigned width, unsigned height, const uint8_t *rows, size_t count)
+{
+    ONLINE_QUANTIZER *q = ctx;
+
+    if (q->histogram == NULL)
+        oq_init(q, width, height);
+
+    oq_update(q, rows, count);
+}
+
+/*
+ * build palette from quantizer state, centroids are ordered
+ * by population to pair with most populated bins, empty
+ * centroids fall back to bin color
+ */
+PALETTE oq_finish(ONLINE_QUANTIZER *q)
+{
+    PALETTE palette = { .extended = NULL, .size = PALETTE_SIZE };
+
+    RGB bin_colors[PALETTE_SIZE / 2];
+    histogram_top_bins(q->histogram, q->hk, bin_colors);
+
+    size_t order[PALETTE_SIZE / 2];
+    for (size_t i = 0; i < PALETTE_SIZE / 2; i++)
+        order[i] = i;
+
+    for (size_t i = 1; i < PALETTE_SIZE / 2; i++)
+        for (size_t k = i; k > 0 && q->counts[order[k]] > q->counts[order[k - 1]]; k--)
+        {
+            size_t temp = order[k];
+            order[k] = order[k - 1];
+            order[k - 1] = temp;
+        }
+
+    RGB box_colors[PALETTE_SIZE / 2];
+    for (size_t i = 0; i < PALETTE_SIZE / 2; i++)
+    {
+        const float *c = q->centroids[order[i]];
+        if (q->counts[order[i]] == 0)
+            box_colors[i] = bin_colors[i];
+        else
+            box_colors[i] = (RGB){ (uint8_t)(c[0] + 0.5f), (uint8_t)(c[1] + 0.5f), (uint8_t)(c[2] + 0.5f) };
+    }
+
+    RGB samples[SAMPLE_REGIONS];
+    for (size_t j = 0; j < SAMPLE_REGIONS; j++)
+    {
+        unsigned long n = q->region_sums[j][3] ? q->region_sums[j][3] : 1;
+        samples[j] = (RGB){ q->region_sums[j][0] / n, q->region_sums[j][1] / n, q->region_sums[j][2] / n };
+    }
+
+    palette_assemble(&palette, box_colors, bin_colors, samples, SAMPLE_REGIONS);
+
+    if (ARGS.DEBUG != 0)
+        log_c("\n---\n");
+
+    free(q->histogram);
+    q->histogram = NULL;
+
+    return palette;
+}
+
+/*
+ * generate palette while image is being decoded,
+ * extended colors are blended from base ones
+ */
+PALETTE gen_palette_streaming(char *filename)
+{
+    ONLINE_QUANTIZER q = { .histogram = NULL };
+
+    log_c("Streaming image %s", filename);
+
+    if (!img_stream_rows(filename, oq_rows_callback, &q) || q.histogram == NULL)
+        err("Error while loading the file: %s", filename);
+
+    PALETTE palette = oq_finish(&q);
+
+    if (ARGS.PALETTE_COLORS > PALETTE_SIZE)
+    {
+        palette_alloc_extended(&palette, ARGS.PALETTE_COLORS);
+        palette_extend_from_base(&palette, 0);
+    }
+
+    return palette;
+}
+
+/* allocate storage for extended colors, matching requested size */
+void palette_alloc_extended(PALETTE *p, unsigned size)
+{
+    p->size = size;
+    p->extended = NULL;
+
+    if (size <= PALETTE_SIZE)
+        return;
+
+    p->extended = calloc(size - PALETTE_SIZE, sizeof(RGB));
+    if (p->extended == NULL)
+        err("Failed to allocate memory for extended palette");
+}
+
+/*
+ * fill extended colors [from .. size) by blending base colors,
+ * used when there is no image to take them from (themes)
+ */
+void palette_extend_from_base(PALETTE *p, unsigned from)
+{
+    unsigned count = p->size - PALETTE_SIZE;
+
+    for (unsigned i = from; i < count; i++)
+    {
+        RGB a = p->colors[i % PALETTE_SIZE];
+        RGB b = p->colors[(i + 1 + i / PALETTE_SIZE) % PALETTE_SIZE];
+        p->extended[i] = blend_colors(a, b, (float)(i / PALETTE_SIZE + 1) / (count / PALETTE_SIZE + 2));
+    }
+}
+
+/*
+ * generate extended colors (16 .. size-1) from image,
+ * median cut into (size - 16) boxes, sorted by luminance
+ */
+void gen_palette_extended(IMG *img, uint8_t *weights, PALETTE *p)
+{
+    size_t total_pixels = img->size / 3;
+    size_t target = ARGS.PALETTE_COLORS - PALETTE_SIZE;
+
+    palette_alloc_extended(p, ARGS.PALETTE_COLORS);
+
+    size_t *starts = calloc(target, sizeof(size_t));
+    size_t *ends = calloc(target, sizeof(size_t));
+    if (starts == NULL || ends == NULL)
+        err("Failed to allocate memory for extended palette");
+
+    ends[0] = total_pixels;
+    size_t num_boxes = 1;
+
+    median_cut((RGB *)img->pixels, weights, starts, ends, &num_boxes, target);
+
+    for (size_t i = 0; i < target; i++)
+        p->extended[i] = average_color(img, weights, starts[i], ends[i]);
+
+    qsort(p->extended, target, sizeof(RGB), _compare_luminance_qsort);
+
+    free(starts);
+    free(ends);
+}
+
+/* Writes palete to stdout */
+void print_palette(PALETTE pal)
+{
+    if (ARGS.QUIET != 0)
+        return;
+
+    for (size_t i=0; i<PALETTE_SIZE; i++)
+    {
+        print_color(pal.colors[i]);
+        if (i+1 == PALETTE_SIZE/2) printf("\n");
+    }
+    printf("\n");
+
+    for (size_t i=PALETTE_SIZE; i<pal.size; i++)
+    {
+        print_color(pal.extended[i - PALETTE_SIZE]);
+        if ((i+1) % PALETTE_SIZE == 0 || i+1 == pal.size) printf("\n");
+    }
+}
+
+/* formats every color of palette in every COLOR_TYPES */
+void color_table_init(COLOR_TABLE *colors, const PALETTE *p)
+{
+    colors->size = p->size;
+
+    for (unsigned c = 0; c < p->size; c++)
+    {
+        RGB col = palette_get(p, c);
+        for (int type = 0; type < COLOR_FORMATS; type++)
+            colors->len[c][type] = format_color(colors->text[c][type], sizeof(colors->text[c][type]), col, type);
+    }
+}
+
+/* 
+ * color of palette as hex or rgb by setting up type, NULL if there's no such color
+ */
+const char *palette_color(const COLOR_TABLE *colors, unsigned c, enum COLOR_TYPES type)
+{
+    if (c >= colors->size)
+        return NULL;
+
+    return colors->text[c][type];
+}
+
+/* writes color to buf in given format, returns its length */
+int format_color(char *buf, size_t size, RGB col, enum COLOR_TYPES type)
+{
+    switch (type) {
+    case HEX_t:
+        return snprintf(buf, size, "%02x%02x%02x", col.R, col.G, col.B);
+    case RGB_t:
+        return snprintf(buf, size, "%d, %d, %d", col.R, col.G, col.B);
+    case R_t:
+        return snprintf(buf, size, "%d", col.R);
+    case G_t:
+        return snprintf(buf, size, "%d", col.G);
+    case B_t:
+        return snprintf(buf, size, "%d", col.B);
+    }
+
+    return 0;
+}
+
+/* print gray-scale palettes */
+void print_palette_gray_scale_iter(IMG *img, size_t iter)
+{
+    if (img == NULL) return;
+
+    PALETTE pal;
+
+    for (size_t i = 0; i < iter; i++)
+    {
+        ARGS.GRAY_SCALE = (float)i == 0 ? 0 : (float)((float)i/iter);
+
+        sort_palette_by_luminance(&pal);
+
+        printf("GRAYSCALE VALUE: %f\n", ARGS.GRAY_SCALE);
+        print_palette(pal);
+    }
+
+    ARGS.GRAY_SCALE = -1.f;
+}
+
+/* Load image file using stb, return IMG structure */
+IMG *img_load(char *filename)
+{
+    if (ARGS.IMAGE == NULL)
+        err("No image provided");
+    log_c("Loading image %s", ARGS.IMAGE);
+
+    int width, height;
+    int numberOfChannels;
+    int forcedNumberOfChannels = 3;
+
+    uint8_t *imageData = stbi_load(filename, &width, &height, &numberOfChannels, forcedNumberOfChannels);
+
+    if (imageData == 0) err("Error while loading the file: %s", filename);
+
+    IMG *img = malloc(sizeof(IMG));
+
+    img->size = width * height * forcedNumberOfChannels;
+    img->pixels = imageData;
+    img->width = width;
+    img->height = height;
+
+    log_c("Loaded!");
+    return img;
+}
+
+/* read next ascii number of PNM header, skips whitespaces and comments, -1 on error */
+long pnm_header_value(FILE *f)
+{
+    int c = fgetc(f);
+    while (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '#')
+    {
+        if (c == '#')
+            while (c != EOF && c != '\n')
+                c = fgetc(f);
+        c = fgetc(f);
+    }
+
+    if (c < '0' || c > '9')
+        return -1;
+
+    long value = 0;
+    while (c >= '0' && c <= '9' && value < 1L << 24)
+    {
+        value = value * 10 + (c - '0');
+        c = fgetc(f);
+    }
+
+    /* single whitespace after value is consumed by last fgetc */
+    return value;
+}
+
+#ifdef HELLWAL_LIBJPEG
+typedef struct
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} JPEG_ERROR;
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((JPEG_ERROR *)cinfo->err)->jump, 1);
+}
+
+/* libjpeg warnings, like truncated file, are shown only in debug mode */
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    if (ARGS.DEBUG != 0)
+        log_c("libjpeg: %s", message);
+}
+#endif
+
+/*
+ * JPEG scanlines through libjpeg, STREAM_ROWS at a time;
+ * returns 1 on success, 0 on error, -1 if it's not decoded here
+ */
+int jpeg_stream_rows(FILE *f, row_callback_t cb, void *ctx)
+{
+#ifdef HELLWAL_LIBJPEG
+    struct jpeg_decompress_struct cinfo;
+    JPEG_ERROR jerr;
+    uint8_t *volatile rows = NULL;
+    volatile int result = 0;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+    jerr.mgr.output_message = jpeg_output_message;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        free(rows);
+        return result;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+
+    /* libjpeg can't convert those to RGB */
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    size_t stride = (size_t)cinfo.output_width * 3;
+    rows = malloc(stride * STREAM_ROWS);
+    if (rows == NULL)
+        err("Failed to allocate memory for image rows");
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        unsigned count = 0;
+        while (count < STREAM_ROWS && cinfo.output_scanline < cinfo.output_height)
+        {
+            JSAMPROW row = rows + count * stride;
+            count += jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+        cb(ctx, cinfo.output_width, cinfo.output_height, rows, count);
+    }
+
+    result = 1;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(rows);
+    return result;
+#else
+    (void)f; (void)cb; (void)ctx;
+    return -1;
+#endif
+}
+
+/*
+ * non-interlaced PNG rows through libpng, converted to 8 bit RGB;
+ * returns 1 on success, 0 on error, -1 if it's not decoded here
+ */
+int png_stream_rows(FILE *f, row_callback_t cb, void *ctx)
+{
+#ifdef HELLWAL_LIBPNG
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    uint8_t *volatile rows = NULL;
+
+    if (info == NULL)
+    {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return 0;
+    }
+
+    if (setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_read_struct(&png, &info, NULL);
+        free(rows);
+        return 0;
+    }
+
+    png_init_io(png, f);
+    png_read_info(png, info);
+
+    /* interlaced rows are complete only after last pass */
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+    {
+        png_destroy_read_struct(&png, &info, NULL);
+        return -1;
+    }
+
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    png_set_gray_to_rgb(png);
+    png_read_update_info(png, info);
+
+    png_uint_32 width = png_get_image_width(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    size_t stride = (size_t)width * 3;
+    if (png_get_rowbytes(png, info) != stride)
+    {
+        png_destroy_read_struct(&png, &info, NULL);
+        return -1;
+    }
+
+    rows = malloc(stride * STREAM_ROWS);
+    if (rows == NULL)
+        err("Failed to allocate memory for image rows");
+
+    for (png_uint_32 y = 0; y < height; y += STREAM_ROWS)
+    {
+        unsigned count = height - y < STREAM_ROWS ? height - y : STREAM_ROWS;
+        for (unsigned i = 0; i < count; i++)
+            png_read_row(png, rows + i * stride, NULL);
+        cb(ctx, width, height, rows, count);
+    }
+
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    free(rows);
+    return 1;
+#else
+    (void)f; (void)cb; (void)ctx;
+    return -1;
+#endif
+}
+
+/*
+ * decode image and pass it to cb in blocks of STREAM_ROWS rows (RGB).
+ * Only these are read row by row without buffering whole image:
+ *   - binary PPM (P6, maxval 255), always
+ *   - JPEG and non-interlaced PNG, if built with STREAM_DECODERS=1
+ * anything else is decoded by stb at once and then handed over in
+ * blocks, so memory is bounded only for formats above.
+ * returns 1 on success
+ */
+int img_stream_rows(char *filename, row_callback_t cb, void *ctx)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return 0;
+
+    uint8_t magic[4] = {0};
+    size_t magic_len = fread(magic, 1, sizeof(magic), f);
+    int decoded = -1;
+
+    if (magic_len >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF)
+    {
+        rewind(f);
+        decoded = jpeg_stream_rows(f, cb, ctx);
+    }
+    else if (magic_len == 4 && memcmp(magic, "\x89PNG", 4) == 0)
+    {
+        rewind(f);
+        decoded = png_stream_rows(f, cb, ctx);
+    }
+
+    if (decoded >= 0)
+    {
+        fclose(f);
+        return decoded;
+    }
+
+    long width = -1, height = -1, maxval = -1;
+    rewind(f);
+    if (fgetc(f) == 'P' && fgetc(f) == '6')
+    {
+        width = pnm_header_value(f);
+        height = pnm_header_value(f);
+        maxval = pnm_header_value(f);
+    }
+
+    if (width > 0 && height > 0 && maxval == 255)
+    {
+        size_t stride = (size_t)width * 3;
+        uint8_t *rows = malloc(stride * STREAM_ROWS);
+        if (rows == NULL)
+            err("Failed to allocate memory for image rows");
+
+        long y = 0;
+        while (y < height)
+        {
+            size_t count = height - y < STREAM_ROWS ? (size_t)(height - y) : STREAM_ROWS;
+            if (fread(rows, stride, count, f) != count)
+                break;
+
+            cb(ctx, width, height, rows, count);
+            y += count;
+        }
+
+        free(rows);
+        fclose(f);
+        return y == height;
+    }
+    fclose(f);
+
+    /* fallback, decoder has no row interface */
+    if (ARGS.DEBUG != 0)
+        log_c("No row decoder for %s, decoding whole image", filename);
+
+    int w, h, channels;
+    uint8_t *pixels = stbi_load(filename, &w, &h, &channels, 3);
+    if (pixels == NULL)
+        return 0;
+
+    for (int y = 0; y < h; y += STREAM_ROWS)
+    {
+        size_t count = h - y < STREAM_ROWS ? (size_t)(h - y) : STREAM_ROWS;
+        cb(ctx, w, h, pixels + (size_t)y * w * 3, count);
+    }
+
+    stbi_image_free(pixels);
+    return 1;
+}
+
+/* 
+ * nearest neighbour sample of image on regular grid,
+ * about [target] pixels, keeps image proportions
+ */
+IMG *img_sample(IMG *img, size_t target)
+{
+    size_t total = (size_t)img->width * img->height;
+    size_t step = (size_t)sqrt((double)total / target);
+    if (step < 1) step = 1;
+
+    IMG *sample = malloc(sizeof(IMG));
+    if (sample == NULL)
+        err("Failed to allocate memory for image sample");
+
+    sample->width = img->width / step;
+    sample->height = img->height / step;
+    sample->size = (size_t)sample->width * sample->height * 3;
+    sample->pixels = malloc(sample->size ? sample->size : 3);
+    if (sample->pixels == NULL)
+        err("Failed to allocate memory for image sample");
+
+    uint8_t *out = sample->pixels;
+    for (size_t y = 0; y < sample->height; y++)
+    {
+        const uint8_t *row = img->pixels + (y * step + step / 2) * img->width * 3;
+        for (size_t x = 0; x < sample->width; x++, out += 3)
+            memcpy(out, row + (x * step + step / 2) * 3, 3);
+    }
+
+    return sample;
+}
+
+/* free all allocated stuff in IMG */
+void img_free(IMG *img)
+{
+    stbi_image_free(img->pixels);
+    free(img);
+}
+
+/* 
+ * overides default terminal color variables from PALETTE
+ * This works thanks to this (and chatgpt):
+ * - https://github.com/dylanaraps/paleta
+ * - https://github.com/alacritty/alacritty/issues/656
+ * - http://pod.tst.eu/http://cvs.schmorp.de/rxvt-unicode/doc/rxvt.7.pod#XTerm_Operating_System_Commands
+ *
+ * Manipulate special colors.
+ *   10 = foreground,
+ *   11 = background,
+ *   12 = cursor foreground,
+ *   13 = mouse foreground,
+ *   708 = terminal border background
+ *
+ *   \033]{index};{color}\007
+ */
+void set_term_colors(const COLOR_TABLE *colors)
+{
+    size_t succ = 0;
+    if (ARGS.SKIP_TERM_COLORS == 0)
+    {
+        /* every sequence is at most 24 bytes long,
+         * extended palettes do not fit on the stack buffer */
+        char stack_buffer[1024];
+        char *buffer = stack_buffer;
+        size_t buffer_size = sizeof(stack_buffer);
+        size_t offset = 0;
+
+        if (colors->size > PALETTE_SIZE)
+        {
+            buffer_size = (colors->size + 4) * 24;
+            buffer = malloc(buffer_size);
+            if (buffer == NULL)
+                err("Failed to allocate memory for terminal sequences");
+        }
+
+        const char *fmt_s = "\033]%d;#%s\033\\";
+        const char *fmt_p = "\033]4;%d;#%s\033\\";
+
+        /* Create the sequences */
+        for (unsigned i = 0; i < colors->size; i++)
+        {
+            const char *color = palette_color(colors, i, HEX_t);
+            offset += snprintf(buffer + offset, buffer_size - offset, fmt_p, i, color);
+        }
+        const char *bg_color     = palette_color(colors, 0,  HEX_t);
+        const char *fg_color     = palette_color(colors, PALETTE_SIZE - 1, HEX_t);
+        const char *cursor_color = palette_color(colors, PALETTE_SIZE - 1, HEX_t);
+        const char *border_color = palette_color(colors, PALETTE_SIZE - 1, HEX_t);
+
+        fg_color = fg_color ? fg_color : "FFFFFF";             /* Default to white */
+        bg_color = bg_color ? bg_color : "000000";             /* Default to black */
+        cursor_color = cursor_color ? cursor_color : "FFFFFF"; /* Default to white */
+        border_color = border_color ? border_color : "000000"; /* Default to black */
+
+        offset += snprintf(buffer + offset, buffer_size - offset, fmt_s, 10, fg_color);
+        offset += snprintf(buffer + offset, buffer_size - offset, fmt_s, 11, bg_color);
+        offset += snprintf(buffer + offset, buffer_size - offset, fmt_s, 12, cursor_color);
+        offset += snprintf(buffer + offset, buffer_size - offset, fmt_s, 708, border_color);
+
+        /* Broadcast the sequences to all terminal devices */
+        glob_t globbuf;
+        if (glob("/dev/pts/*", GLOB_NOSORT, NULL, &globbuf) == 0)
+        {
+            for (size_t i = 0; i < globbuf.gl_pathc; i++)
+            {
+                FILE *f = fopen(globbuf.gl_pathv[i], "w");
+                if (f)
+                {
                     fwrite(buffer, 1, offset, f);
                     fclose(f);
                     succ++;
                 }
             }
-            globfree(&globbuf);
+            globfree(&globbuf);
+        }
+
+        /*
+         * Only write to stdout if it's a terminal,
+         * to not conflict with other programs like jq
+         */
+        if (isatty(STDOUT_FILENO))
+        {
+            fwrite(buffer, 1, offset, stdout);
+            succ++;
+        }
+
+        if (buffer != stack_buffer)
+            free(buffer);
+
+    }
+    log_c("Set colors to [%d] terminals!", succ);
+}
+
+void palette_record_init(PALETTE_RECORD *r, const PALETTE *p, const uint8_t *signature, uint64_t key, enum CACHE_TIER tier, enum QUANTIZER_BACKEND backend)
+{
+    /* padding is zeroed too, checksum covers it */
+    memset(r, 0, sizeof(*r));
+    memcpy(r->magic, CACHE_MAGIC, 4);
+    r->version = CACHE_VERSION;
+    r->key = key;
+
+    r->bins = get_histogram_kernel(ARGS.BINS_COUNT)->bins;
+    r->weighting = (uint8_t)ARGS.WEIGHTING;
+    r->backend = (uint8_t)backend;
+    r->tier = (uint8_t)tier;
+
+    if (signature != NULL)
+    {
+        r->has_signature = 1;
+        memcpy(r->signature, signature, SIGNATURE_SIZE);
+    }
+
+    if (p->has_boxes)
+    {
+        r->has_boxes = 1;
+        memcpy(r->boxes, p->boxes, sizeof(r->boxes));
+    }
+
+    r->size = p->size;
+    for (unsigned i = 0; i < p->size; i++)
+        r->colors[i] = palette_get(p, i);
+
+    r->checksum = hash_bytes((const uint8_t *)r, offsetof(PALETTE_RECORD, checksum), 0);
+}
+
+/*
+ * validates cache record, key 0 accepts any key
+ * returns 0 if it's corrupted or of other version
+ */
+int palette_record_valid(const PALETTE_RECORD *r, uint64_t key)
+{
+    return memcmp(r->magic, CACHE_MAGIC, 4) == 0
+        && r->version == CACHE_VERSION
+        && (key == 0 || r->key == key)
+        && r->size >= PALETTE_SIZE && r->size <= PALETTE_MAX_SIZE
+        && r->checksum == hash_bytes((const uint8_t *)r, offsetof(PALETTE_RECORD, checksum), 0);
+}
+
+/* palette made with other quantizer parameters is not reused (palette size is checked by caller),
+ * one made from cached histogram only with --histogram-cache */
+int palette_record_params_match(const PALETTE_RECORD *r)
+{
+    return r->bins == get_histogram_kernel(ARGS.BINS_COUNT)->bins
+        && r->weighting == (uint8_t)ARGS.WEIGHTING
+        && (r->backend == quantizer_backend() || (ARGS.HISTOGRAM_CACHE != 0 && r->backend == QUANTIZER_HISTOGRAM));
+}
+
+/* OUTPUT/cache/palettes<ext> */
+char *cache_db_path(const char *ext)
+{
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/palettes") + strlen(ext) + 1;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/cache/palettes%s", ARGS.OUTPUT, ext);
+    return path;
+}
+
+/* flock on the lock file, database itself is replaced on rebuild; returns fd or -1 */
+int cache_db_lock(int operation)
+{
+    char *path = cache_db_path(".lock");
+    int fd = path ? open(path, O_RDWR | O_CREAT, 0644) : -1;
+    free(path);
+
+    if (fd >= 0 && flock(fd, operation) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+static inline size_t cache_db_signatures_offset(uint32_t slots)
+{
+    return sizeof(CACHE_DB_HEADER) + (size_t)slots * sizeof(CACHE_DB_SLOT);
+}
+
+static inline size_t cache_db_records_offset(uint32_t slots)
+{
+    return cache_db_signatures_offset(slots) + (size_t)slots * SIGNATURE_SIZE;
+}
+
+/* signature of raw record goes to the table, see CACHE_SLOT_SIGNED */
+static inline uint32_t cache_db_slot_flags(const PALETTE_RECORD *r)
+{
+    return r->tier == CACHE_TIER_RAW && r->has_signature && r->has_boxes ? CACHE_SLOT_SIGNED : 0;
+}
+
+/* header of mapped database is sane and its records fit in the file */
+static int cache_db_header_valid(const CACHE_DB_HEADER *h, size_t file_size)
+{
+    return memcmp(h->magic, CACHE_DB_MAGIC, 4) == 0 && h->version == CACHE_DB_VERSION
+        && h->slots != 0 && (h->slots & (h->slots - 1)) == 0
+        && cache_db_records_offset(h->slots) + (size_t)h->records * sizeof(PALETTE_RECORD) <= file_size;
+}
+
+/* slot of key, or first empty slot it would go to */
+static uint32_t cache_db_probe(const CACHE_DB_SLOT *index, uint32_t slots, uint64_t key)
+{
+    uint32_t i = (uint32_t)key & (slots - 1);
+    for (uint32_t n = 0; n < slots && index[i].record != 0 && index[i].key != key; n++)
+        i = (i + 1) & (slots - 1);
+    return i;
+}
+
+/*
+ * finds newest record of key, it's copied out of read-only mapping;
+ * access stamp of the slot is refreshed only once it is older than
+ * CACHE_STAMP_GRANULARITY, so hits don't dirty the index. Rebuild needs
+ * exclusive lock, database can't be replaced while stamp is written
+ */
+int cache_db_lookup(uint64_t key, PALETTE_RECORD *r)
+{
+    int lock = cache_db_lock(LOCK_SH);
+    if (lock < 0)
+        return 0;
+
+    char *path = cache_db_path(".db");
+    int fd = path ? open(path, O_RDONLY) : -1;
+
+    int found = 0;
+    struct stat st;
+    off_t stamp_at = -1;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CACHE_DB_HEADER))
+    {
+        uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            const CACHE_DB_HEADER *h = (const CACHE_DB_HEADER *)map;
+
+            if (cache_db_header_valid(h, st.st_size))
+            {
+                const CACHE_DB_SLOT *index = (const CACHE_DB_SLOT *)(map + sizeof(CACHE_DB_HEADER));
+                uint32_t i = cache_db_probe(index, h->slots, key);
+
+                if (index[i].record != 0 && index[i].record <= h->records)
+                {
+                    memcpy(r, map + cache_db_records_offset(h->slots) + (size_t)(index[i].record - 1) * sizeof(PALETTE_RECORD), sizeof(*r));
+                    found = palette_record_valid(r, key);
+
+                    if (found && (uint32_t)time(NULL) - index[i].stamp > CACHE_STAMP_GRANULARITY)
+                        stamp_at = sizeof(CACHE_DB_HEADER) + (off_t)i * sizeof(CACHE_DB_SLOT) + offsetof(CACHE_DB_SLOT, stamp);
+                }
+            }
+            munmap(map, st.st_size);
         }
+    }
 
-        /*
-         * Only write to stdout if it's a terminal,
-         * to not conflict with other programs like jq
-         */
-        if (isatty(STDOUT_FILENO))
+    if (fd >= 0)
+        close(fd);
+
+    if (stamp_at >= 0)
+    {
+        uint32_t now = (uint32_t)time(NULL);
+        int wfd = open(path, O_WRONLY);
+        if (wfd >= 0)
         {
-            fwrite(buffer, 1, offset, stdout);
-            succ++;
+            if (pwrite(wfd, &now, sizeof(now), stamp_at) != (ssize_t)sizeof(now) && ARGS.DEBUG != 0)
+                log_c("Failed to refresh cache access stamp");
+            close(wfd);
         }
+    }
+
+    free(path);
+    close(lock);
+
+    return found;
+}
 
+/*
+ * Copies live records of database behind fd into new one with given
+ * index size, which replaces it. Replaced records are dropped, so are
+ * live ones whose old slot is not set in keep (NULL keeps all).
+ * returns fd of new database or -1
+ */
+int cache_db_rebuild(int fd, const CACHE_DB_HEADER *h, uint32_t slots, const uint8_t *keep)
+{
+    char *path = cache_db_path(".db");
+    char *tmp_path = cache_db_path(".db.tmp");
+    CACHE_DB_SLOT *old_index = NULL, *index = calloc(slots, sizeof(CACHE_DB_SLOT));
+    uint8_t *signatures = calloc(slots, SIGNATURE_SIZE);
+    int out = -1;
+
+    if (path == NULL || tmp_path == NULL || index == NULL || signatures == NULL)
+        goto done;
+
+    CACHE_DB_HEADER nh = *h;
+    memcpy(nh.magic, CACHE_DB_MAGIC, 4);
+    nh.version = CACHE_DB_VERSION;
+    nh.slots = slots;
+    nh.records = 0;
+    nh.live = 0;
+    nh.bytes = 0;
+
+    out = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+        goto done;
+
+    if (h->slots != 0)
+    {
+        old_index = malloc((size_t)h->slots * sizeof(CACHE_DB_SLOT));
+        if (old_index == NULL || pread(fd, old_index, (size_t)h->slots * sizeof(CACHE_DB_SLOT), sizeof(CACHE_DB_HEADER))
+                != (ssize_t)((size_t)h->slots * sizeof(CACHE_DB_SLOT)))
+            h = NULL;
     }
-    log_c("Set colors to [%d] terminals!", succ);
+
+    /* live records are appended in index order, stamps and sizes go along */
+    for (uint32_t i = 0; h != NULL && i < h->slots; i++)
+    {
+        if (old_index[i].record == 0 || old_index[i].record > h->records || (keep != NULL && !keep[i]))
+            continue;
+
+        PALETTE_RECORD r;
+        off_t from = cache_db_records_offset(h->slots) + (off_t)(old_index[i].record - 1) * sizeof(PALETTE_RECORD);
+        off_t to = cache_db_records_offset(slots) + (off_t)nh.records * sizeof(PALETTE_RECORD);
+
+        if (pread(fd, &r, sizeof(r), from) != (ssize_t)sizeof(r) || !palette_record_valid(&r, old_index[i].key))
+            continue;
+        if (pwrite(out, &r, sizeof(r), to) != (ssize_t)sizeof(r))
+            break;
+
+        uint32_t s = cache_db_probe(index, slots, r.key);
+        index[s] = (CACHE_DB_SLOT){ r.key, ++nh.records, old_index[i].stamp, old_index[i].bytes, cache_db_slot_flags(&r) };
+        if (index[s].flags & CACHE_SLOT_SIGNED)
+            memcpy(signatures + (size_t)s * SIGNATURE_SIZE, r.signature, SIGNATURE_SIZE);
+        nh.live++;
+        nh.bytes += old_index[i].bytes;
+    }
+
+    if (pwrite(out, &nh, sizeof(nh), 0) != (ssize_t)sizeof(nh)
+        || pwrite(out, index, (size_t)slots * sizeof(CACHE_DB_SLOT), sizeof(nh)) != (ssize_t)((size_t)slots * sizeof(CACHE_DB_SLOT))
+        || pwrite(out, signatures, (size_t)slots * SIGNATURE_SIZE, cache_db_signatures_offset(slots)) != (ssize_t)((size_t)slots * SIGNATURE_SIZE)
+        || ftruncate(out, cache_db_records_offset(slots) + (off_t)nh.records * sizeof(PALETTE_RECORD)) != 0
+        || rename(tmp_path, path) != 0)
+    {
+        close(out);
+        unlink(tmp_path);
+        out = -1;
+    }
+
+done:
+    free(path);
+    free(tmp_path);
+    free(index);
+    free(signatures);
+    free(old_index);
+    return out;
+}
+
+/* index size for given number of entries, at most half full */
+static uint32_t cache_db_slots_for(uint32_t entries)
+{
+    uint32_t slots = CACHE_DB_SLOTS;
+    while (slots < (entries + 1) * 2)
+        slots *= 2;
+    return slots;
+}
+
+/* bytes entry takes: record, its slot and files kept next to it,
+ * stat()ed once when it is stored */
+static size_t cache_entry_cost(uint64_t key)
+{
+    static const char *exts[] = { ".hist", ".hellwal" };
+    size_t cost = sizeof(PALETTE_RECORD) + sizeof(CACHE_DB_SLOT) + SIGNATURE_SIZE;
+
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/") + 16 + 16;
+    char *path = malloc(len);
+    for (size_t i = 0; path != NULL && i < sizeof(exts) / sizeof(exts[0]); i++)
+    {
+        struct stat st;
+        snprintf(path, len, "%s/cache/%016llx%s", ARGS.OUTPUT, (unsigned long long)key, exts[i]);
+        if (stat(path, &st) == 0)
+            cost += st.st_size;
+    }
+    free(path);
+
+    return cost;
+}
+
+/* removes files kept next to evicted entry */
+static void cache_entry_remove_files(uint64_t key)
+{
+    static const char *exts[] = { ".hist", ".hellwal" };
+
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/") + 16 + 16;
+    char *path = malloc(len);
+    for (size_t i = 0; path != NULL && i < sizeof(exts) / sizeof(exts[0]); i++)
+    {
+        snprintf(path, len, "%s/cache/%016llx%s", ARGS.OUTPUT, (unsigned long long)key, exts[i]);
+        unlink(path);
+    }
+    free(path);
+}
+
+typedef struct { uint32_t slot; uint32_t stamp; } LRU_ENTRY;
+
+int _compare_lru_qsort(const void *a, const void *b)
+{
+    uint32_t sa = ((const LRU_ENTRY *)a)->stamp, sb = ((const LRU_ENTRY *)b)->stamp;
+    return (sa < sb) - (sa > sb); /* most recent first */
+}
+
+/*
+ * LRU eviction: if live entries exceed --cache-max-entries or their size
+ * exceeds --cache-max-size, keep is set for the most recently used ones
+ * fitting into 90% of the limits, so eviction does not run on every store.
+ * Keys of evicted entries go to victims (if not NULL, room for all live
+ * ones), their files are removed by caller once rebuilt database is in place.
+ * returns number of evicted entries, 0 if limits are not exceeded
+ */
+uint32_t cache_db_select_lru(const CACHE_DB_SLOT *index, uint32_t slots, uint8_t *keep, uint64_t *victims)
+{
+    if (ARGS.CACHE_MAX_ENTRIES == 0 && ARGS.CACHE_MAX_SIZE == 0)
+        return 0;
+
+    LRU_ENTRY *entries = malloc(slots * sizeof(LRU_ENTRY));
+    if (entries == NULL)
+        return 0;
+
+    uint32_t live = 0;
+    size_t total = sizeof(CACHE_DB_HEADER);
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        keep[i] = 0;
+        if (index[i].record == 0)
+            continue;
+
+        entries[live++] = (LRU_ENTRY){ i, index[i].stamp };
+        total += index[i].bytes;
+    }
+
+    uint32_t evicted = 0;
+    if ((ARGS.CACHE_MAX_ENTRIES != 0 && live > ARGS.CACHE_MAX_ENTRIES)
+        || (ARGS.CACHE_MAX_SIZE != 0 && total > ARGS.CACHE_MAX_SIZE))
+    {
+        size_t max_entries = ARGS.CACHE_MAX_ENTRIES ? ARGS.CACHE_MAX_ENTRIES * 9 / 10 : SIZE_MAX;
+        size_t max_size = ARGS.CACHE_MAX_SIZE ? ARGS.CACHE_MAX_SIZE / 10 * 9 : SIZE_MAX;
+        size_t kept = 0, size = sizeof(CACHE_DB_HEADER);
+
+        qsort(entries, live, sizeof(LRU_ENTRY), _compare_lru_qsort);
+
+        for (uint32_t i = 0; i < live; i++)
+        {
+            uint32_t s = entries[i].slot;
+            if (kept < max_entries && size + index[s].bytes <= max_size)
+            {
+                keep[s] = 1;
+                kept++;
+                size += index[s].bytes;
+            }
+            else
+            {
+                if (victims != NULL)
+                    victims[evicted] = index[s].key;
+                evicted++;
+            }
+        }
+    }
+    else
+        memset(keep, 1, slots);
+
+    free(entries);
+    return evicted;
+}
+
+/* cache limits are exceeded, checked from header alone */
+static int cache_db_over_limits(const CACHE_DB_HEADER *h)
+{
+    return (ARGS.CACHE_MAX_ENTRIES != 0 && h->live > ARGS.CACHE_MAX_ENTRIES)
+        || (ARGS.CACHE_MAX_SIZE != 0 && sizeof(*h) + h->bytes > ARGS.CACHE_MAX_SIZE);
+}
+
+/* appends record and points index to it, under exclusive lock;
+ * bytes is what entry takes with its files, see cache_entry_cost() */
+int cache_db_store(const PALETTE_RECORD *r, size_t bytes)
+{
+    int lock = cache_db_lock(LOCK_EX);
+    if (lock < 0)
+        return 0;
+
+    char *path = cache_db_path(".db");
+    int fd = path ? open(path, O_RDWR | O_CREAT, 0644) : -1;
+    free(path);
+
+    CACHE_DB_HEADER h = {0};
+    struct stat st;
+    int ok = 0;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+        goto done;
+
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || !cache_db_header_valid(&h, st.st_size))
+    {
+        /* new or unusable database starts over */
+        memset(&h, 0, sizeof(h));
+        int nfd = cache_db_rebuild(fd, &h, CACHE_DB_SLOTS, NULL);
+        close(fd);
+        if ((fd = nfd) < 0)
+            goto done;
+    }
+    else if ((h.live + 1) * 2 > h.slots)
+    {
+        int nfd = cache_db_rebuild(fd, &h, h.slots * 2, NULL);
+        close(fd);
+        if ((fd = nfd) < 0)
+            goto done;
+    }
+
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+        goto done;
+
+    size_t index_size = cache_db_records_offset(h.slots) - sizeof(h);
+    uint8_t *map = mmap(NULL, sizeof(h) + index_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto done;
+
+    CACHE_DB_SLOT *slots = (CACHE_DB_SLOT *)(map + sizeof(h));
+    off_t at = cache_db_records_offset(h.slots) + (off_t)h.records * sizeof(PALETTE_RECORD);
+
+    /* record goes first, index only points to complete ones */
+    if (pwrite(fd, r, sizeof(*r), at) == (ssize_t)sizeof(*r))
+    {
+        uint32_t s = cache_db_probe(slots, h.slots, r->key);
+        CACHE_DB_SLOT *slot = &slots[s];
+        if (slot->record == 0)
+            h.live++;
+        else
+            h.bytes -= slot->bytes;
+
+        /* signature before slot flags it */
+        if (cache_db_slot_flags(r) & CACHE_SLOT_SIGNED)
+            memcpy(map + cache_db_signatures_offset(h.slots) + (size_t)s * SIGNATURE_SIZE, r->signature, SIGNATURE_SIZE);
+        *slot = (CACHE_DB_SLOT){ r->key, ++h.records, (uint32_t)time(NULL), (uint32_t)bytes, cache_db_slot_flags(r) };
+        h.bytes += slot->bytes;
+        memcpy(map, &h, sizeof(h));
+        ok = 1;
+    }
+
+    /* evict least recently used entries if limits are exceeded */
+    uint8_t *keep = NULL;
+    uint64_t *victims = NULL;
+    uint32_t evicted = 0;
+    if (ok && cache_db_over_limits(&h))
+    {
+        keep = malloc(h.slots);
+        victims = malloc(h.live * sizeof(uint64_t));
+        if (keep != NULL && victims != NULL)
+            evicted = cache_db_select_lru(slots, h.slots, keep, victims);
+    }
+    munmap(map, sizeof(h) + index_size);
+
+    if (evicted != 0)
+    {
+        /* files go only when database without their entries replaced old one */
+        int nfd = cache_db_rebuild(fd, &h, cache_db_slots_for(h.live - evicted), keep);
+        if (nfd >= 0)
+        {
+            close(fd);
+            fd = nfd;
+
+            for (uint32_t i = 0; i < evicted; i++)
+                cache_entry_remove_files(victims[i]);
+
+            if (ARGS.DEBUG != 0)
+                log_c("Evicted %u least recently used cache entries", evicted);
+        }
+        else
+            warn("Failed to evict cache entries");
+    }
+    free(keep);
+    free(victims);
+
+done:
+    if (fd >= 0)
+        close(fd);
+    close(lock);
+    return ok;
+}
+
+/* is key among sorted live keys */
+static int cache_key_live(const uint64_t *keys, size_t count, const char *name)
+{
+    char *end;
+    if (strlen(name) < 16)
+        return 0;
+
+    char hex[17];
+    memcpy(hex, name, 16);
+    hex[16] = '\0';
+
+    uint64_t key = strtoull(hex, &end, 16);
+    if (*end != '\0')
+        return 0;
+
+    size_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < count && keys[lo] == key;
+}
+
+int _compare_u64_qsort(const void *a, const void *b)
+{
+    uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+    return (ka > kb) - (ka < kb);
+}
+
+/* removes files in dir whose name (or symlink target) is not a live key, returns how many */
+static size_t cache_remove_orphans(const char *dir_path, const uint64_t *keys, size_t count, int links)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+        return 0;
+
+    size_t removed = 0;
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        snprintf(path, sizeof(path), "%s%s", dir_path, name);
+
+        int live;
+        if (links)
+        {
+            char target[17] = {0};
+            if (entry->d_type != DT_LNK || readlink(path, target, 16) < 0)
+                continue;
+            live = cache_key_live(keys, count, target);
+        }
+        else
+        {
+            int ours = (len > 5 && !strcmp(name + len - 5, ".hist"))
+                || (len > 8 && !strcmp(name + len - 8, ".hellwal"))
+                || (len > 8 && !strcmp(name + len - 8, ".palette"));
+            if (!ours)
+                continue;
+            /* per-file .palette records are not used anymore */
+            live = strcmp(name + len - 8, ".palette") != 0 && cache_key_live(keys, count, name);
+        }
+
+        if (!live && unlink(path) == 0)
+            removed++;
+    }
+    closedir(dir);
+
+    return removed;
+}
+
+/*
+ * --cache-gc: evicts entries over the limits, compacts database (replaced
+ * records are dropped, index is resized) and removes files of entries
+ * that are no longer in it
+ */
+void cache_gc(void)
+{
+    size_t dir_len = strlen(ARGS.OUTPUT) + strlen("/cache/ids/") + 1;
+    char *cache_dir = malloc(dir_len), *ids_dir = malloc(dir_len);
+    if (cache_dir == NULL || ids_dir == NULL)
+        err("Failed to allocate memory for cache paths");
+    snprintf(cache_dir, dir_len, "%s/cache/", ARGS.OUTPUT);
+    snprintf(ids_dir, dir_len, "%s/cache/ids/", ARGS.OUTPUT);
+
+    int lock = cache_db_lock(LOCK_EX);
+    if (lock < 0)
+    {
+        log_c("No cache in %s", cache_dir);
+        free(cache_dir);
+        free(ids_dir);
+        return;
+    }
+
+    char *path = cache_db_path(".db");
+    int fd = path ? open(path, O_RDWR) : -1;
+    free(path);
+
+    CACHE_DB_HEADER h = {0};
+    struct stat st;
+    uint64_t *keys = NULL;
+    size_t count = 0, before = 0, evicted = 0, removed = 0;
+    int compacted = 0;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h)
+        && cache_db_header_valid(&h, st.st_size))
+    {
+        before = st.st_size;
+
+        CACHE_DB_SLOT *index = malloc((size_t)h.slots * sizeof(CACHE_DB_SLOT));
+        uint8_t *keep = malloc(h.slots);
+        if (index == NULL || keep == NULL
+            || pread(fd, index, (size_t)h.slots * sizeof(CACHE_DB_SLOT), sizeof(h)) != (ssize_t)((size_t)h.slots * sizeof(CACHE_DB_SLOT)))
+            err("Failed to read cache index");
+
+        evicted = cache_db_select_lru(index, h.slots, keep, NULL);
+        if (evicted == 0)
+            memset(keep, 1, h.slots);
+
+        keys = malloc((h.live + 1) * sizeof(uint64_t));
+        if (keys == NULL)
+            err("Failed to allocate memory for cache keys");
+        for (uint32_t i = 0; i < h.slots; i++)
+            if (index[i].record != 0 && keep[i])
+                keys[count++] = index[i].key;
+        qsort(keys, count, sizeof(uint64_t), _compare_u64_qsort);
+
+        /* evicted entries are orphans only once rebuilt database is in place */
+        int nfd = cache_db_rebuild(fd, &h, cache_db_slots_for(count), keep);
+        if (nfd < 0)
+            warn("Failed to compact cache database");
+        else
+        {
+            compacted = 1;
+            fstat(nfd, &st);
+            close(nfd);
+        }
+
+        free(index);
+        free(keep);
+    }
+    else
+        log_c("No valid cache database in %s, cache files are kept", cache_dir);
+    if (fd >= 0)
+        close(fd);
+
+    /* keys are known only from database that was read, without it
+     * every file would look like orphan */
+    if (compacted)
+    {
+        removed = cache_remove_orphans(cache_dir, keys, count, 0);
+        removed += cache_remove_orphans(ids_dir, keys, count, 1);
+
+        log_c("Cache: %zu entries, %zu -> %zu bytes, %zu evicted, %zu stale files removed",
+              count, before, (size_t)st.st_size, evicted, removed);
+    }
+
+    /* compiled templates are keyed by source path, not by database */
+    size_t programs = template_program_gc();
+    if (programs != 0)
+        log_c("Removed %zu compiled templates of removed sources", programs);
+
+    close(lock);
+
+    free(keys);
+    free(cache_dir);
+    free(ids_dir);
+}
+
+/* reads signature table of live signed entries, records are not touched */
+void cache_db_scan_signatures(cache_db_signature_callback_t cb, void *ctx)
+{
+    int lock = cache_db_lock(LOCK_SH);
+    if (lock < 0)
+        return;
+
+    char *path = cache_db_path(".db");
+    int fd = path ? open(path, O_RDONLY) : -1;
+    free(path);
+
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CACHE_DB_HEADER))
+    {
+        uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            const CACHE_DB_HEADER *h = (const CACHE_DB_HEADER *)map;
+
+            if (cache_db_header_valid(h, st.st_size))
+            {
+                const CACHE_DB_SLOT *index = (const CACHE_DB_SLOT *)(map + sizeof(CACHE_DB_HEADER));
+                const uint8_t *signatures = map + cache_db_signatures_offset(h->slots);
+
+                for (uint32_t i = 0; i < h->slots; i++)
+                    if (index[i].record != 0 && (index[i].flags & CACHE_SLOT_SIGNED)
+                        && cb(index[i].key, signatures + (size_t)i * SIGNATURE_SIZE, ctx))
+                        break;
+            }
+            munmap(map, st.st_size);
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    close(lock);
 }
 
 /* cache wallpaper color palette */
-void palette_write_cache(char *filepath, PALETTE *p)
+void palette_write_cache(char *filepath, PALETTE *p, const uint8_t *signature, enum QUANTIZER_BACKEND backend)
 {
     if (ARGS.NO_CACHE != 0 || ARGS.JSON != 0)
         return;
@@ -1718,11 +5100,28 @@ void palette_write_cache(char *filepath, PALETTE *p)
     if (filepath == NULL)
         return;
 
-    char *filename = basename(filepath);
+    char key[17];
+    if (!cache_key(filepath, key))
+        return;
+
+    uint64_t k = strtoull(key, NULL, 16);
+    PALETTE_RECORD r;
+    palette_record_init(&r, p, signature, k, CACHE_TIER_RAW, backend);
+
+    /* before the record, so its size includes the export */
+    if (ARGS.CACHE_TEXT != 0)
+        palette_export_text(key, p, backend);
+
+    if (!cache_db_store(&r, cache_entry_cost(k)))
+        warn("Failed to write palette to cache database");
+}
 
-    size_t cache_file_len = strlen(filename) + strlen(".hellwal") + 1;
+/* human readable copy of cached palette, it is never read back */
+void palette_export_text(const char *key, PALETTE *p, enum QUANTIZER_BACKEND backend)
+{
+    size_t cache_file_len = strlen(key) + strlen(".hellwal") + 1;
     char *cache_file = (char*)malloc(cache_file_len);
-    snprintf(cache_file, cache_file_len, "%s.hellwal", filename);
+    snprintf(cache_file, cache_file_len, "%s.hellwal", key);
 
     size_t cache_dir_len = strlen(ARGS.OUTPUT) + strlen("/cache/") + 1;
     char *cache_dir = (char*)malloc(cache_dir_len);
@@ -1731,18 +5130,38 @@ void palette_write_cache(char *filepath, PALETTE *p)
     char *full_cache_path = (char*)malloc(strlen(cache_dir) + strlen(cache_file) + 1);
     snprintf(full_cache_path, strlen(cache_dir) + strlen(cache_file) + 1, "%s%s", cache_dir, cache_file);
 
-    /* create dir if not exits */
-    check_output_dir(cache_dir);
+    /* create and process template, extended colors are appended */
+    char *extended_template = NULL;
+    if (p->size > PALETTE_SIZE)
+        extended_template = template_extend(CACHE_TEMPLATE, NULL, "\\%%\\%%color%u = #%%%% color%u.hex %%%% \\%%\\%%\n");
 
-    /* create and process template */
     TEMPLATE t;
-    t.content = CACHE_TEMPLATE;
+    t.content = extended_template ? extended_template : CACHE_TEMPLATE;
     t.path = full_cache_path;
     t.name = cache_file;
 
-    process_template(&t, *p);
+    COLOR_TABLE colors;
+    color_table_init(&colors, p);
+    process_template(&t, &colors);
+
+    /* parameters palette was made with */
+    if (t.content != NULL)
+    {
+        char params[128];
+        quantizer_params(params, sizeof(params), backend);
+
+        size_t len = strlen(t.content);
+        t.content = realloc(t.content, len + sizeof(params) + 32);
+        if (t.content == NULL)
+            err("Failed to allocate memory for cache entry");
+
+        sprintf(t.content + len, "%%%%params = %s%%%%\n", params);
+    }
+
     template_write(&t, cache_dir);
 
+    free(extended_template);
+
     free(cache_file);
     free(cache_dir);
     free(full_cache_path);
@@ -1757,232 +5176,924 @@ int check_cached_palette(char *filepath, PALETTE *p)
     if (filepath == NULL)
         return 0;
 
-    char *filename = basename(filepath);
+    /* cache dir is created by cache_init() */
+    char key[17];
+    if (!cache_key(filepath, key))
+        return 0;
 
-    size_t cache_file_len = strlen(filename) + strlen(".hellwal") + 1;
-    char *cache_file = (char*)malloc(cache_file_len);
-    snprintf(cache_file, cache_file_len, "%s.hellwal", filename);
+    PALETTE_RECORD r;
+    int result = cache_db_lookup(strtoull(key, NULL, 16), &r) && r.tier == CACHE_TIER_RAW;
 
-    size_t cache_dir_len = strlen(ARGS.OUTPUT) + strlen("/cache/") + 1;
-    char *cache_dir = (char*)malloc(cache_dir_len);
-    snprintf(cache_dir, cache_dir_len, "%s/cache/", ARGS.OUTPUT);
+    if (result == 0)
+    {
+        if (ARGS.DEBUG != 0)
+            log_c("No cached palette for %s", key);
+    }
+    else if (!palette_record_params_match(&r) || r.size < ARGS.PALETTE_COLORS)
+    {
+        if (ARGS.DEBUG != 0)
+            log_c("Cached palette %s was made with other parameters", key);
+        result = 0;
+    }
+    else
+        palette_from_record(&r, p);
 
-    char *full_cache_path = (char*)malloc(strlen(cache_dir) + strlen(cache_file) + 1);
-    snprintf(full_cache_path, strlen(cache_dir) + strlen(cache_file) + 1, "%s%s", cache_dir, cache_file);
+    return result;
+}
+
+/* first ARGS.PALETTE_COLORS colors of record */
+void palette_from_record(const PALETTE_RECORD *r, PALETTE *p)
+{
+    palette_alloc_extended(p, ARGS.PALETTE_COLORS);
+    memcpy(p->colors, r->colors, sizeof(p->colors));
+    memcpy(p->boxes, r->boxes, sizeof(p->boxes));
+    p->has_boxes = r->has_boxes;
+    if (p->extended != NULL)
+        memcpy(p->extended, r->colors + PALETTE_SIZE, (p->size - PALETTE_SIZE) * sizeof(RGB));
+}
+
+/*
+ * Key of post-processed palette: image key combined with every flag
+ * that changes the result, in canonical form (mode set by default,
+ * offsets as they are summed up, floats with fixed precision).
+ * returns 0 if image can't be keyed
+ */
+uint64_t final_palette_key(const char *filepath)
+{
+    char key[17];
+    if (!cache_key(filepath, key))
+        return 0;
+
+    const char *mode = ARGS.COLOR_MODE ? "color" : (ARGS.LIGHT_MODE ? "light" : "dark");
+    if (ARGS.DARK_MODE && (ARGS.LIGHT_MODE || ARGS.COLOR_MODE))
+        mode = ARGS.LIGHT_MODE ? (ARGS.COLOR_MODE ? "dark+light+color" : "dark+light") : "dark+color";
+    else if (ARGS.LIGHT_MODE && ARGS.COLOR_MODE)
+        mode = "light+color";
+
+    char bg[8] = "-", fg[8] = "-";
+    if (ARGS.STATIC_BG != NULL)
+        snprintf(bg, sizeof(bg), "%02x%02x%02x", ARGS.STATIC_BG->R, ARGS.STATIC_BG->G, ARGS.STATIC_BG->B);
+    if (ARGS.STATIC_FG != NULL)
+        snprintf(fg, sizeof(fg), "%02x%02x%02x", ARGS.STATIC_FG->R, ARGS.STATIC_FG->G, ARGS.STATIC_FG->B);
+
+    char flags[256];
+    int len = snprintf(flags, sizeof(flags),
+        "size:%u bins:%u weighting:%u backend:%u mode:%s neon:%d invert:%d "
+        "offset:%.4f gray:%.4f bg:%s fg:%s contrast:%d sort:%d histogram-cache:%d warm-start:%d",
+        ARGS.PALETTE_COLORS, get_histogram_kernel(ARGS.BINS_COUNT)->bins, (unsigned)ARGS.WEIGHTING,
+        (unsigned)quantizer_backend(), mode, ARGS.NEON_MODE, ARGS.INVERT,
+        ARGS.OFFSET_GLOBAL, ARGS.GRAY_SCALE, bg, fg, ARGS.CHECK_CONTRAST, !ARGS.SKIP_LUMINANCE_SORTING,
+        ARGS.HISTOGRAM_CACHE, !ARGS.NO_WARM_START);
+
+    return hash_bytes((const uint8_t *)flags, len, strtoull(key, NULL, 16));
+}
+
+/* final palette for this image and flags, if it was computed before */
+int check_final_palette(char *filepath, PALETTE *p)
+{
+    if (ARGS.NO_CACHE != 0 || ARGS.THEME != NULL || filepath == NULL)
+        return 0;
+
+    uint64_t key = final_palette_key(filepath);
+    PALETTE_RECORD r;
+
+    if (key == 0 || !cache_db_lookup(key, &r) || r.tier != CACHE_TIER_FINAL || r.size < ARGS.PALETTE_COLORS)
+        return 0;
+
+    if (ARGS.DEBUG != 0)
+        log_c("Using cached final palette %016llx", (unsigned long long)key);
+
+    palette_from_record(&r, p);
+    return 1;
+}
+
+/* stores palette after apply_addtional_arguments() */
+void palette_write_final(char *filepath, PALETTE *p)
+{
+    if (ARGS.NO_CACHE != 0 || ARGS.JSON != 0 || ARGS.THEME != NULL || filepath == NULL)
+        return;
+
+    uint64_t key = final_palette_key(filepath);
+    if (key == 0)
+        return;
+
+    PALETTE_RECORD r;
+    palette_record_init(&r, p, NULL, key, CACHE_TIER_FINAL, quantizer_backend());
+
+    if (!cache_db_store(&r, sizeof(PALETTE_RECORD) + sizeof(CACHE_DB_SLOT) + SIGNATURE_SIZE))
+        warn("Failed to write palette to cache database");
+}
+
+char *process_addtional_variables(char *color, const char *right_token, enum COLOR_TYPES type)
+{
+    if (color == NULL) return NULL;
+    if (right_token == NULL) return color;
+    char *result = NULL;
+
+    hell_parser_t p;
+    hell_parser_init(&p, right_token, strlen(right_token));
+    if (hell_parser_delim(&p, '=', 1) == HELL_PARSER_OK)
+    {
+        hell_span_t variable = { p.input, p.pos - 1 };
+        const char *value = p.pos < p.length ? p.input + p.pos + 1 : "";
+
+        if (hell_span_eq(variable, "alpha"))
+        {
+            result = process_variable_alpha(color, value, type);
+        }
+    }
+
+    if (result != NULL)
+        return result;
+
+     return color;
+}
+
+char *process_variable_alpha(char *color, const char *value, enum COLOR_TYPES type)
+{
+    if ((type != HEX_t && type != RGB_t) || !is_between_01_float(value))
+        return color;
+
+    const float alpha_value = strtod(value, NULL);
+    char *buffer = NULL;
+
+    if (type == HEX_t)
+    {
+        buffer = malloc(sizeof(color) + 3); // 3 because 2 next hex aplha numbers
+                                            // and 1 null termination
+        int a = (int)(alpha_value * 255);
+        sprintf(buffer, "%s%02x", color, a);
+    }
+    else // we can safely assume it's rgb
+    {
+        buffer = malloc(sizeof(color) + sizeof(",    "));
+        sprintf(buffer, "%s, %f", color, alpha_value);
+    }
+
+    if (buffer != NULL)
+        return buffer;
+
+    return color;
+}
+
+/* 
+ * Loads content from file file to buffer,
+ * returns buffer if succeded, otherwise NULL
+ */
+char *load_file(char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    int size = ftell(file);
+    rewind(file);
+
+    char *buffer = (char*)malloc(size + 1); // +1 for null terminator
+    if (buffer == NULL)
+    {
+        warn("Failed to allocate memory for file buffer");
+        fclose(file);
+        return NULL;
+    }
+
+    int bytes_read = fread(buffer, 1, size, file);
+    if (bytes_read != size)
+    {
+        perror("Failed to read the complete file");
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[size] = '\0';
+
+    fclose(file);
+
+    return buffer;
+}
+
+/* empty buffer with room for cap bytes */
+void strbuf_init(STRBUF *b, size_t cap)
+{
+    b->cap = cap + 1;
+    b->len = 0;
+    b->data = malloc(b->cap);
+    if (b->data == NULL)
+        err("Failed to allocate memory for template buffer");
+    b->data[0] = '\0';
+}
+
+/* appends n bytes of s, capacity doubles so appending stays linear */
+void strbuf_append(STRBUF *b, const char *s, size_t n)
+{
+    if (b->len + n + 1 > b->cap)
+    {
+        while (b->len + n + 1 > b->cap)
+            b->cap *= 2;
+
+        b->data = realloc(b->data, b->cap);
+        if (b->data == NULL)
+            err("Failed to allocate memory for template buffer");
+    }
+
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+/*
+ * copy base template and insert line_fmt for every extended
+ * color right after first occurence of 'after' (or at the end if NULL),
+ * line_fmt takes color index twice, caller must free result
+ */
+char *template_extend(const char *base, const char *after, const char *line_fmt)
+{
+    size_t base_len = strlen(base);
+    size_t split = base_len;
+
+    if (after != NULL)
+    {
+        const char *found = strstr(base, after);
+        if (found != NULL)
+            split = (found - base) + strlen(after);
+    }
+
+    size_t line_max = strlen(line_fmt) + 8;
+    size_t size = base_len + (ARGS.PALETTE_COLORS - PALETTE_SIZE) * line_max + 1;
+    char *buffer = malloc(size);
+    if (buffer == NULL)
+        err("Failed to allocate memory for template");
+
+    memcpy(buffer, base, split);
+    size_t offset = split;
+
+    for (unsigned i = PALETTE_SIZE; i < ARGS.PALETTE_COLORS; i++)
+        offset += snprintf(buffer + offset, size - offset, line_fmt, i, i);
+
+    memcpy(buffer + offset, base + split, base_len - split + 1);
+
+    return buffer;
+}
+
+/* 
+ * reads content of all given and found templates paths,
+ * and writes to specified or default output folder.
+ */
+void process_templating(const COLOR_TABLE *colors)
+{
+    if (ARGS.JSON != 0)
+    {
+        char *extended_template = NULL;
+        if (colors->size > PALETTE_SIZE)
+            extended_template = template_extend(JSON_TEMPLATE, "\"color15\": \"#%% color15.hex %%\"",
+                                                ",\n    \"color%u\": \"#%%%% color%u.hex %%%%\"");
+
+        TEMPLATE t;
+        t.content = extended_template ? extended_template : JSON_TEMPLATE;
+        t.path = "";
+        t.name = "";
+
+        /* printf json template to stdout */
+        process_template(&t, colors);
+        fprintf(stdout, "%s",t.content);
+
+        free(extended_template);
+
+        return;
+    }
+
+    if (ARGS.DEBUG != 0)
+        log_c("Processing templates: ");
+
+    TEMPLATE **templates;
+    size_t templates_count, t_written = 0, t_unchanged = 0;
+
+    /* Process templates loaded from folder */
+    templates = get_template_structure_dir(ARGS.TEMPLATE_FOLDER, &templates_count);
+    if (templates == NULL) return;
+
+    /* readdir order is arbitrary, report in the same order every run */
+    qsort(templates, templates_count, sizeof(TEMPLATE *), _compare_template_qsort);
+
+    int *results = calloc(templates_count, sizeof(int));
+    if (results == NULL)
+        err("Failed to allocate memory for templates");
+
+    TEMPLATE_JOBS jobs = { templates, templates_count, colors, ARGS.OUTPUT, NULL, results, 0 };
+    unsigned threads = ARGS.JOBS < templates_count ? ARGS.JOBS : (unsigned)templates_count;
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    unsigned started = 0;
+
+    check_output_dir(ARGS.OUTPUT);
+
+    /* --generations: everything goes to fresh dir, nothing is visible
+     * until 'current' is switched to it at once */
+    char generation[64] = "";
+    char *current = NULL;
+    int generation_fd = -1;
+    if (ARGS.GENERATIONS != 0)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(generation, sizeof(generation), "%lld%09ld-%d",
+                 (long long)ts.tv_sec, ts.tv_nsec, (int)getpid());
+
+        char *generations = generation_dir("");
+        check_output_dir(generations);
+        free(generations);
+
+        /* generation is locked while it's filled, so concurrent run doesn't prune it;
+         * it's created and locked under lock of generations dir, pruning takes it too */
+        int generations_lock = generation_lock("", LOCK_EX);
+        jobs.dir = generation_dir(generation);
+        check_output_dir(jobs.dir);
+        generation_fd = generation_lock(generation, LOCK_EX);
+        if (generations_lock >= 0)
+            close(generations_lock);
+
+        current = generation_link_target("current");
+        if (current != NULL)
+            jobs.compare_dir = generation_dir(current);
+    }
+
+    /* this thread is one of the workers */
+    for (unsigned i = 1; workers != NULL && i < threads; i++)
+        if (pthread_create(&workers[started], NULL, template_worker, &jobs) == 0)
+            started++;
+
+    template_worker(&jobs);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    static const char *result_names[] = { "failed", "written", "unchanged" };
+    for (size_t i = 0; i < templates_count; i++)
+    {
+        t_written += results[i] == TEMPLATE_WRITE_DONE;
+        t_unchanged += results[i] == TEMPLATE_WRITE_UNCHANGED;
+        if (ARGS.DEBUG != 0)
+            log_c("  - %s: %s", templates[i]->name, result_names[results[i]]);
+    }
+
+    log_c("Processed [%zu/%zu] templates! (%zu written, %zu unchanged)",
+          t_written + t_unchanged, templates_count, t_written, t_unchanged);
+
+    if (ARGS.GENERATIONS != 0)
+    {
+        if (t_written + t_unchanged != templates_count)
+        {
+            /* incomplete generation would take failed outputs away from consumers */
+            generation_remove(generation);
+            warn("%zu templates failed, keeping generation: %s",
+                 templates_count - t_written - t_unchanged, current ? current : "none");
+        }
+        else if (current != NULL && t_unchanged == templates_count)
+        {
+            /* nothing would change for consumers, don't make them reload */
+            generation_remove(generation);
+            log_c("Templates unchanged, keeping generation: %s", current);
+        }
+        else if (generation_link_swap("current", generation))
+        {
+            if (current != NULL)
+                generation_link_swap("previous", current);
+            generation_prune(generation, current);
+            log_c("Switched to generation: %s", generation);
+        }
+        else
+            warn("Failed to switch to generation: %s", generation);
+
+        if (generation_fd >= 0)
+            close(generation_fd);
+        free(jobs.dir);
+        free(jobs.compare_dir);
+        free(current);
+    }
+
+    free(workers);
+    free(results);
+}
+
+int _compare_template_qsort(const void *a, const void *b)
+{
+    return strcmp((*(TEMPLATE *const *)a)->name, (*(TEMPLATE *const *)b)->name);
+}
+
+/* renders and writes templates until there are none left, run by every thread */
+void *template_worker(void *arg)
+{
+    TEMPLATE_JOBS *jobs = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&jobs->next, 1)) < jobs->count)
+    {
+        TEMPLATE *t = jobs->templates[i];
+        process_template(t, jobs->colors);
+        jobs->results[i] = template_write(t, jobs->dir);
+
+        /* new generation is always written, unchanged means same as in current one */
+        if (jobs->results[i] == TEMPLATE_WRITE_DONE && jobs->compare_dir != NULL)
+        {
+            char *path = malloc(strlen(jobs->compare_dir) + strlen(t->name) + 1);
+            if (path != NULL)
+            {
+                sprintf(path, "%s%s", jobs->compare_dir, t->name);
+                if (file_content_equals(path, t->content, strlen(t->content)))
+                    jobs->results[i] = TEMPLATE_WRITE_UNCHANGED;
+                free(path);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* OUTPUT/generations/<name>/ */
+char *generation_dir(const char *name)
+{
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/generations/") + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path == NULL)
+        err("Failed to allocate memory for generation path");
+
+    if (name[0] == '\0')
+        snprintf(path, len, "%s/generations/", ARGS.OUTPUT);
+    else
+        snprintf(path, len, "%s/generations/%s/", ARGS.OUTPUT, name);
+    return path;
+}
+
+/* name of generation OUTPUT/<link> points to, NULL if there is none */
+char *generation_link_target(const char *link)
+{
+    size_t len = strlen(ARGS.OUTPUT) + strlen(link) + 2;
+    char *path = malloc(len);
+    char target[PATH_MAX];
+    if (path == NULL)
+        return NULL;
+
+    snprintf(path, len, "%s/%s", ARGS.OUTPUT, link);
+    ssize_t n = readlink(path, target, sizeof(target) - 1);
+    free(path);
+    if (n <= 0)
+        return NULL;
+    target[n] = '\0';
+
+    /* links are always "generations/<name>" */
+    const char *prefix = "generations/";
+    if (strncmp(target, prefix, strlen(prefix)) != 0 || strchr(target + strlen(prefix), '/') != NULL)
+        return NULL;
+
+    return strdup(target + strlen(prefix));
+}
+
+/* point OUTPUT/<link> to generation, new symlink is renamed over old one,
+ * so readers follow either old or new link, never none. returns 1 on success */
+int generation_link_swap(const char *link, const char *name)
+{
+    size_t len = strlen(ARGS.OUTPUT) + strlen(link) + strlen(name) + 64;
+    char *path = malloc(len);
+    char *tmp_path = malloc(len);
+    char *target = malloc(len);
+    int ok = 0;
+
+    if (path == NULL || tmp_path == NULL || target == NULL)
+        goto done;
+
+    snprintf(path, len, "%s/%s", ARGS.OUTPUT, link);
+    snprintf(tmp_path, len, "%s/.%s.%d.tmp", ARGS.OUTPUT, link, (int)getpid());
+    snprintf(target, len, "generations/%s", name);
 
-    /* create dir if not exits */
-    check_output_dir(cache_dir);
+    unlink(tmp_path);
+    if (symlink(target, tmp_path) != 0)
+        goto done;
 
-    char *theme = load_file(full_cache_path);
+    if (rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        goto done;
+    }
 
-    int result = 1;
-    if (theme == NULL)
+    if (ARGS.DURABLE != 0)
     {
-        warn("Failed to open file: %s", full_cache_path);
-        result = 0;
+        int dfd = open(ARGS.OUTPUT, O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0)
+        {
+            fsync(dfd);
+            close(dfd);
+        }
     }
-    else
+    ok = 1;
+
+done:
+    free(path);
+    free(tmp_path);
+    free(target);
+    return ok;
+}
+
+/* delete generation dir with all outputs in it */
+void generation_remove(const char *name)
+{
+    char *dir_path = generation_dir(name);
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
     {
-        /* cached palette is stored as theme */
-        result = process_theme(theme, p);
+        free(dir_path);
+        return;
     }
 
-    free(cache_file);
-    free(cache_dir);
-    free(full_cache_path);
+    size_t dir_len = strlen(dir_path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char *path = malloc(dir_len + strlen(entry->d_name) + 1);
+        if (path == NULL)
+            continue;
+        sprintf(path, "%s%s", dir_path, entry->d_name);
+        unlink(path);
+        free(path);
+    }
 
-    return result;
+    closedir(dir);
+    rmdir(dir_path);
+    free(dir_path);
 }
 
-char *process_addtional_variables(char *color, char *right_token, enum COLOR_TYPES type)
+/* flock on generation dir, "" is generations dir itself; returns fd or -1 */
+int generation_lock(const char *name, int operation)
 {
-    if (color == NULL) return NULL;
-    if (right_token == NULL) return color;
-    char *result = NULL;
+    char *path = generation_dir(name);
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    free(path);
 
-    hell_parser_t *p = hell_parser_create(right_token);
-    if (hell_parser_delim(p, '=', 1) == HELL_PARSER_OK)
+    if (fd >= 0 && flock(fd, operation) != 0)
     {
-        size_t var_size = p->pos - 1;
-        size_t val_size = p->length - p->pos + 1;
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/* only current and previous generations are kept,
+ * and ones concurrent runs are still filling */
+void generation_prune(const char *keep, const char *keep_previous)
+{
+    char *dir_path = generation_dir("");
+    DIR *dir = opendir(dir_path);
+    free(dir_path);
+    if (dir == NULL)
+        return;
 
-        char *variable = calloc(1, var_size);
-        char *value = calloc(1, val_size);
+    int lock = generation_lock("", LOCK_EX);
 
-        strncpy(variable, p->input, var_size);
-        strncpy(value, p->input + p->pos + 1, val_size);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+            continue;
+        if (strcmp(entry->d_name, keep) == 0 || (keep_previous && strcmp(entry->d_name, keep_previous) == 0))
+            continue;
 
-        if (!strcmp(variable, "alpha"))
+        int fd = generation_lock(entry->d_name, LOCK_EX | LOCK_NB);
+        if (fd < 0)
         {
-            result = process_variable_alpha(color, value, type);
+            if (ARGS.DEBUG != 0)
+                log_c("  - generation in use: %s", entry->d_name);
+            continue;
         }
-    }
 
-    if (result != NULL)
-        return result;
+        if (ARGS.DEBUG != 0)
+            log_c("  - removing generation: %s", entry->d_name);
+        generation_remove(entry->d_name);
+        close(fd);
+    }
 
-     return color;
+    if (lock >= 0)
+        close(lock);
+    closedir(dir);
 }
 
-char *process_variable_alpha(char *color, char *value, enum COLOR_TYPES type)
+/* swap 'current' and 'previous', outputs are not rendered again */
+void generation_rollback(void)
 {
-    if ((type != HEX_t && type != RGB_t) || !is_between_01_float(value))
-        return color;
+    char *current = generation_link_target("current");
+    char *previous = generation_link_target("previous");
 
-    const float alpha_value = strtod(value, NULL);
-    char *buffer = NULL;
+    if (previous == NULL)
+        err("No previous generation in: %s", ARGS.OUTPUT);
 
-    if (type == HEX_t)
-    {
-        buffer = malloc(sizeof(color) + 3); // 3 because 2 next hex aplha numbers
-                                            // and 1 null termination
-        int a = (int)(alpha_value * 255);
-        sprintf(buffer, "%s%02x", color, a);
-    }
-    else // we can safely assume it's rgb
-    {
-        buffer = malloc(sizeof(color) + sizeof(",    "));
-        sprintf(buffer, "%s, %f", color, alpha_value);
-    }
+    if (!generation_link_swap("current", previous))
+        err("Failed to switch to generation: %s", previous);
 
-    if (buffer != NULL)
-        return buffer;
+    if (current != NULL)
+        generation_link_swap("previous", current);
 
-    return color;
+    log_c("Switched back to generation: %s", previous);
+
+    free(current);
+    free(previous);
 }
 
-/* 
- * Loads content from file file to buffer,
- * returns buffer if succeded, otherwise NULL
- */
-char *load_file(char *filename)
+enum COLOR_TYPES parse_color_type(hell_span_t str)
 {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL)
-        return NULL;
+    if (hell_span_eq(str, "rgb"))
+        return RGB_t;
 
-    fseek(file, 0, SEEK_END);
-    int size = ftell(file);
-    rewind(file);
+    switch (str.len ? str.ptr[0] : '\0') {
+    case 'r': return R_t;
+    case 'g': return G_t;
+    case 'b': return B_t;
+    }
 
-    char *buffer = (char*)malloc(size + 1); // +1 for null terminator
-    if (buffer == NULL)
+    return HEX_t;
+}
+
+/* empty program, pool presized for literals of len bytes long template */
+void template_program_init(TEMPLATE_PROGRAM *prog, size_t len)
+{
+    prog->count = 0;
+    prog->cap = 64;
+    prog->ops = malloc(prog->cap * sizeof(TEMPLATE_OP));
+    if (prog->ops == NULL)
+        err("Failed to allocate memory for template");
+    strbuf_init(&prog->pool, len);
+}
+
+void template_program_free(TEMPLATE_PROGRAM *prog)
+{
+    free(prog->ops);
+    free(prog->pool.data);
+    prog->ops = NULL;
+    prog->pool.data = NULL;
+}
+
+/* appends instruction, s (n bytes) goes to pool */
+void template_emit(TEMPLATE_PROGRAM *prog, uint8_t op, unsigned slot, enum COLOR_TYPES type, const char *s, size_t n)
+{
+    if (prog->count == prog->cap)
     {
-        warn("Failed to allocate memory for file buffer");
-        fclose(file);
-        return NULL;
+        prog->cap *= 2;
+        prog->ops = realloc(prog->ops, prog->cap * sizeof(TEMPLATE_OP));
+        if (prog->ops == NULL)
+            err("Failed to allocate memory for template");
     }
 
-    int bytes_read = fread(buffer, 1, size, file);
-    if (bytes_read != size)
+    prog->ops[prog->count++] = (TEMPLATE_OP){ op, type, slot, prog->pool.len, n };
+    if (n != 0)
+        strbuf_append(&prog->pool, s, n);
+}
+
+/* literal text, joined with previous literal if there's nothing between them */
+void template_emit_literal(TEMPLATE_PROGRAM *prog, const char *s, size_t n)
+{
+    TEMPLATE_OP *last = prog->count ? &prog->ops[prog->count - 1] : NULL;
+
+    if (last != NULL && last->op == TEMPLATE_OP_LITERAL && last->offset + last->len == prog->pool.len)
     {
-        perror("Failed to read the complete file");
-        free(buffer);
-        fclose(file);
-        return NULL;
+        last->len += n;
+        strbuf_append(&prog->pool, s, n);
     }
-    buffer[size] = '\0';
+    else
+        template_emit(prog, TEMPLATE_OP_LITERAL, 0, HEX_t, s, n);
+}
 
-    fclose(file);
+/* OUTPUT/cache/templates/<hash of path>.hwt */
+static char *template_program_path(const char *path)
+{
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/templates/") + 16 + strlen(".hwt") + 1;
+    char *cache_path = malloc(len);
+    if (cache_path != NULL)
+        snprintf(cache_path, len, "%s/cache/templates/%016llx.hwt", ARGS.OUTPUT,
+                 (unsigned long long)hash_bytes((const uint8_t *)path, strlen(path), 0));
+    return cache_path;
+}
 
-    return buffer;
+static uint64_t template_program_checksum(const TEMPLATE_OP *ops, uint32_t count, const char *pool, uint32_t pool_len)
+{
+    return hash_bytes((const uint8_t *)pool, pool_len, hash_bytes((const uint8_t *)ops, (size_t)count * sizeof(TEMPLATE_OP), 0));
 }
 
-/* 
- * reads content of all given and found templates paths,
- * and writes to specified or default output folder.
+/*
+ * loads compiled template of path if its source did not change since,
+ * st is set to source file stat for template_program_store().
+ * returns 0 if it has to be compiled
  */
-void process_templating(PALETTE pal)
+int template_program_load(const char *path, TEMPLATE_PROGRAM *prog, struct stat *st)
 {
-    if (ARGS.JSON != 0)
+    if (stat(path, st) != 0)
     {
-        TEMPLATE t;
-        t.content = JSON_TEMPLATE;
-        t.path = "";
-        t.name = "";
-
-        /* printf json template to stdout */
-        process_template(&t, pal);
-        fprintf(stdout, "%s",t.content);
-
-        return;
+        memset(st, 0, sizeof(*st));
+        return 0;
     }
 
-    if (ARGS.DEBUG != 0)
-        log_c("Processing templates: ");
+    if (ARGS.NO_CACHE != 0)
+        return 0;
 
-    TEMPLATE **templates;
-    size_t templates_count, t_success = 0;
+    char *cache_path = template_program_path(path);
+    FILE *f = cache_path ? fopen(cache_path, "rb") : NULL;
+    free(cache_path);
+    if (f == NULL)
+        return 0;
 
-    /* Process templates loaded from folder */
-    templates = get_template_structure_dir(ARGS.TEMPLATE_FOLDER, &templates_count);
-    if (templates == NULL) return;
+    TEMPLATE_PROGRAM_HEADER h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1
+        && memcmp(h.magic, TEMPLATE_CACHE_MAGIC, 4) == 0 && h.version == TEMPLATE_CACHE_VERSION
+        && h.mtime_sec == (int64_t)st->st_mtim.tv_sec && h.mtime_nsec == (int64_t)st->st_mtim.tv_nsec
+        && h.size == (uint64_t)st->st_size && h.count != 0;
 
-    check_output_dir(ARGS.OUTPUT);
-    for (size_t i = 0; i < templates_count; i++)
+    if (ok)
     {
-        process_template(templates[i], pal);
-        t_success += template_write(templates[i], ARGS.OUTPUT);
+        prog->count = prog->cap = h.count;
+        prog->ops = malloc((size_t)h.count * sizeof(TEMPLATE_OP));
+        prog->pool.data = malloc((size_t)h.pool_len + 1);
+        prog->pool.len = h.pool_len;
+        prog->pool.cap = (size_t)h.pool_len + 1;
+
+        ok = prog->ops != NULL && prog->pool.data != NULL
+            && fread(prog->ops, sizeof(TEMPLATE_OP), h.count, f) == h.count
+            && fread(prog->pool.data, 1, h.pool_len, f) == h.pool_len
+            && template_program_checksum(prog->ops, h.count, prog->pool.data, h.pool_len) == h.checksum;
+
+        if (ok)
+            prog->pool.data[h.pool_len] = '\0';
+        else
+            template_program_free(prog);
     }
+    fclose(f);
+
+    if (ok && ARGS.DEBUG != 0)
+        log_c("  - using compiled template: %s", path);
 
-    log_c("Processed [%d/%d] templates!", t_success, templates_count);
+    return ok;
 }
 
-enum COLOR_TYPES parse_color_type(const char *str)
+/* writes compiled template, it's replaced atomically so concurrent runs never read half of it */
+void template_program_store(const char *path, const TEMPLATE_PROGRAM *prog, const struct stat *st)
 {
-    if (!strcmp(str, "rgb"))
-        return RGB_t;
+    if (ARGS.NO_CACHE != 0 || st->st_mtim.tv_sec == 0)
+        return;
 
-    switch (str[0]) {
-    case 'r': return R_t;
-    case 'g': return G_t;
-    case 'b': return B_t;
-    }
+    size_t dir_len = strlen(ARGS.OUTPUT) + strlen("/cache/templates/") + 1;
+    char *dir = malloc(dir_len);
+    char *cache_path = template_program_path(path);
+    char *tmp_path = cache_path ? malloc(strlen(cache_path) + 16) : NULL;
+    if (dir == NULL || tmp_path == NULL)
+        goto done;
+
+    snprintf(dir, dir_len, "%s/cache/", ARGS.OUTPUT);
+    check_output_dir(dir);
+    snprintf(dir, dir_len, "%s/cache/templates/", ARGS.OUTPUT);
+    check_output_dir(dir);
+    sprintf(tmp_path, "%s.%d", cache_path, (int)getpid());
+
+    TEMPLATE_PROGRAM_HEADER h = {0};
+    memcpy(h.magic, TEMPLATE_CACHE_MAGIC, 4);
+    h.version = TEMPLATE_CACHE_VERSION;
+    h.mtime_sec = st->st_mtim.tv_sec;
+    h.mtime_nsec = st->st_mtim.tv_nsec;
+    h.size = st->st_size;
+    h.count = prog->count;
+    h.pool_len = prog->pool.len;
+    h.path_len = strlen(path);
+    h.checksum = template_program_checksum(prog->ops, prog->count, prog->pool.data, prog->pool.len);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL)
+        goto done;
 
-    return HEX_t;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+        && fwrite(prog->ops, sizeof(TEMPLATE_OP), prog->count, f) == prog->count
+        && fwrite(prog->pool.data, 1, prog->pool.len, f) == prog->pool.len
+        && fwrite(path, 1, h.path_len, f) == h.path_len;
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, cache_path) != 0)
+        unlink(tmp_path);
+
+done:
+    free(dir);
+    free(cache_path);
+    free(tmp_path);
 }
 
-/* load t->path file to buffer and replaces content between delim with colors from PALETTE colors */
-void process_template(TEMPLATE *t, PALETTE pal)
+/*
+ * --cache-gc: removes compiled templates whose source is gone
+ * or that are of other version, returns how many
+ */
+size_t template_program_gc(void)
 {
-    if (t == NULL) {
-        t->content = NULL;
-        return;
-    }
+    size_t dir_len = strlen(ARGS.OUTPUT) + strlen("/cache/templates/") + 1;
+    char *dir_path = malloc(dir_len);
+    if (dir_path == NULL)
+        return 0;
+    snprintf(dir_path, dir_len, "%s/cache/templates/", ARGS.OUTPUT);
 
-    if (ARGS.DEBUG != 0)
-        log_c("  - generating template buffer: %s", t->name);
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+    {
+        free(dir_path);
+        return 0;
+    }
 
-    char *template_buffer = calloc(1, 1);
-    size_t template_size = 0;
-    int last_pos = 0;
-    int buffrd_pos = 0;
+    size_t removed = 0;
+    struct dirent *entry;
+    char path[PATH_MAX], source[PATH_MAX];
 
-    char *file_content = NULL;
-    if (t->content == NULL)
+    while ((entry = readdir(dir)) != NULL)
     {
-        file_content = load_file(t->path);
-        if (file_content == NULL)
+        size_t len = strlen(entry->d_name);
+        if (len <= 4 || strcmp(entry->d_name + len - 4, ".hwt") != 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", dir_path, entry->d_name);
+        FILE *f = fopen(path, "rb");
+        if (f == NULL)
+            continue;
+
+        TEMPLATE_PROGRAM_HEADER h;
+        struct stat st;
+        int live = fread(&h, sizeof(h), 1, f) == 1
+            && memcmp(h.magic, TEMPLATE_CACHE_MAGIC, 4) == 0 && h.version == TEMPLATE_CACHE_VERSION
+            && h.path_len < sizeof(source)
+            && fseek(f, (long)((size_t)h.count * sizeof(TEMPLATE_OP) + h.pool_len), SEEK_CUR) == 0
+            && fread(source, 1, h.path_len, f) == h.path_len;
+        fclose(f);
+
+        if (live)
         {
-            warn("Failed to open file: %s", t->path);
-            return;
+            source[h.path_len] = '\0';
+            live = stat(source, &st) == 0;
         }
+
+        if (!live && unlink(path) == 0)
+            removed++;
     }
-    else
-    {
-        file_content = t->content;
-    }
+    closedir(dir);
+    free(dir_path);
 
-    hell_parser_t *p = hell_parser_create(file_content);
-    if (p == NULL)
+    return removed;
+}
+
+/* runs compiled template, colors are copied from table */
+void template_render(const TEMPLATE_PROGRAM *prog, const COLOR_TABLE *colors, STRBUF *out)
+{
+    strbuf_init(out, prog->pool.len + (size_t)prog->count * 8);
+
+    for (uint32_t i = 0; i < prog->count; i++)
     {
-        t->content = NULL;
-        return;
+        const TEMPLATE_OP *op = &prog->ops[i];
+
+        switch (op->op) {
+        case TEMPLATE_OP_LITERAL:
+            strbuf_append(out, prog->pool.data + op->offset, op->len);
+            break;
+        case TEMPLATE_OP_COLOR:
+            /* colors above --palette-size are not there */
+            if (op->slot < ARGS.PALETTE_COLORS && op->slot < colors->size)
+            {
+                strbuf_append(out, colors->text[op->slot][op->type], colors->len[op->slot][op->type]);
+                strbuf_append(out, prog->pool.data + op->offset, op->len);
+            }
+            break;
+        case TEMPLATE_OP_WALLPAPER:
+        {
+            const char *w = ARGS.IMAGE ? ARGS.IMAGE : (ARGS.THEME ? ARGS.THEME : "");
+            strbuf_append(out, w, strlen(w));
+            break;
+        }
+        }
     }
+}
+
+/*
+ * parses template src into prog: text between variables becomes
+ * literals, variables become color or wallpaper instructions,
+ * returns 0 on failure
+ */
+int template_compile(const char *src, TEMPLATE_PROGRAM *prog)
+{
+    int last_pos = 0;
+    int buffrd_pos = 0;
+
+    /* parsers live on the stack, variables are views into src */
+    hell_parser_t parser;
+    hell_parser_t *p = &parser;
+    hell_parser_init(p, src, strlen(src));
+
+    template_program_init(prog, p->length);
 
     int skip = 0;
     while (!hell_parser_eof(p))
     {
+        /* only delims and escapes matter, text up to them stays in literal run */
+        if (hell_parser_skip_to(p, HELLWAL_DELIM, '\\') != 0)
+            skip = 0;
+
         char ch;
         if (hell_parser_next(p, &ch) == HELL_PARSER_OK)
         {
@@ -1991,11 +6102,7 @@ void process_template(TEMPLATE *t, PALETTE pal)
                 /* escape delim */
                 if (skip == 1)
                 {
-                    template_size += 2;
-                    template_buffer = realloc(template_buffer, template_size);
-                    if (template_buffer == NULL) return;
-
-                    strncat(template_buffer, p->input + p->pos - 1, 1);
+                    template_emit_literal(prog, p->input + p->pos - 1, 1);
                     buffrd_pos = p->pos;
 
                     skip = 0;
@@ -2013,31 +6120,23 @@ void process_template(TEMPLATE *t, PALETTE pal)
                         /* It's a single %, just add it to the buffer and continue */
                         int size_before_delim = p->pos - buffrd_pos;
                         if (size_before_delim > 0)
-                        {
-                            template_size += size_before_delim + 1;
-                            template_buffer = realloc(template_buffer, template_size);
-                            strncat(template_buffer, p->input + buffrd_pos, size_before_delim);
-                        }
+                            template_emit_literal(prog, p->input + buffrd_pos, size_before_delim);
                         buffrd_pos = p->pos;
                         continue;
                     }
 
                     p->pos -= 1;
                     int idx = 0;
-                    size_t len = 0;
-                    char *var_arg = NULL;
-                    char *delim_buf = NULL;
+                    int slot = -1;
+                    int wallpaper = 0;
+                    hell_span_t var;
                     enum COLOR_TYPES type = HEX_t;
 
                     last_pos = p->pos + 1;
 
                     int size_before_delim = last_pos - buffrd_pos - 1;
                     if (size_before_delim > 0)
-                    {
-                        template_size += size_before_delim + 1;
-                        template_buffer = realloc(template_buffer, template_size);
-                        strncat(template_buffer, p->input + buffrd_pos, size_before_delim);
-                    }
+                        template_emit_literal(prog, p->input + buffrd_pos, size_before_delim);
 
                     /* extract hellwal template style from templates:
                      *
@@ -2054,15 +6153,22 @@ void process_template(TEMPLATE *t, PALETTE pal)
                      *    ```
                      *
                      */
-                    if (hell_parser_delim_buffer_between(p, HELLWAL_DELIM, HELLWAL_DELIM_COUNT, &delim_buf) == HELL_PARSER_OK)
+                    if (hell_parser_delim_span_between(p, HELLWAL_DELIM, HELLWAL_DELIM_COUNT, &var) == HELL_PARSER_OK)
                     {
+                        /* whitespaces are normalized in a copy, on the stack unless it's huge */
+                        char stack_buf[256];
+                        char *delim_buf = var.len < sizeof(stack_buf) ? stack_buf : malloc(var.len + 1);
+                        if (delim_buf == NULL)
+                            err("Failed to allocate memory for template variable");
+
+                        memcpy(delim_buf, var.ptr, var.len);
+                        delim_buf[var.len] = '\0';
                         remove_extra_whitespaces(delim_buf);
-                        hell_parser_t *pdt = hell_parser_create(delim_buf);
-                        char *L_TOKEN = NULL;
-                        char *R_TOKEN = NULL;
 
-                        if (pdt == NULL)
-                            err("Failed to allocate parser");
+                        hell_span_t token = { delim_buf, strlen(delim_buf) };
+                        hell_span_t L_TOKEN = token;
+                        const char *R_TOKEN = NULL;
+                        hell_span_t left, right;
 
                         /* tokenize it by ' ':
                          *
@@ -2078,140 +6184,75 @@ void process_template(TEMPLATE *t, PALETTE pal)
                          *
                          * --------------------------------------------------
                          *
-                         *  %%color7%%"   -   hell_parser_delim will fail and go to else statement
+                         *  %%color7%%"   -   hell_span_split will fail and L_TOKEN is whole variable
                          *    L_TOKEN = "color7";
                          *    R_TOKEN = NULL;
                          *
+                         * R_TOKEN is the rest of delim_buf, so it's null terminated
                          */
 
-                        if (hell_parser_delim(pdt, ' ', 1) == HELL_PARSER_OK) // TODO: make it work with other variables
-                                                                              // (that dont exist yet) - for now this function
-                                                                              // assumes that there are no more than 2 variables
-                                                                              // provided (e.g. color1 + alpha for example)
+                        if (hell_span_split(token, ' ', &left, &right) && left.len != 0 && right.len != 0) // TODO: make it work with other variables
+                                                                                                          // (that dont exist yet) - for now this function
+                                                                                                          // assumes that there are no more than 2 variables
+                                                                                                          // provided (e.g. color1 + alpha for example)
                         {
-                            size_t l_size = pdt->pos - 1;
-                            size_t r_size = pdt->length - pdt->pos;
-
-                            char *left  = calloc(1, l_size);
-                            char *right = calloc(1, r_size);
-
-                            strncpy(left, pdt->input, l_size);
-                            strncpy(right, pdt->input + pdt->pos, r_size);
-
-                            if (ARGS.DEBUG != 0)
-                                log_c("\nLEFT: %s\nRIGHT: %s\n", left, right);
-
                             L_TOKEN = left;
-                            R_TOKEN = right;
+                            R_TOKEN = right.ptr;
 
-                            if (!strcmp(L_TOKEN, "") ||
-                                    (R_TOKEN != NULL && !strcmp(R_TOKEN, "")))
-                            {
-                                free(R_TOKEN);
-                                R_TOKEN = NULL;
-                                L_TOKEN = delim_buf;
-                            }
-                            
                             if (ARGS.DEBUG != 0)
                             {
                                 log_c("--------------------------------------------------");
-                                log_c("L_TOKEN: %s", L_TOKEN);
+                                log_c("L_TOKEN: %.*s", (int)L_TOKEN.len, L_TOKEN.ptr);
                                 log_c("R_TOKEN: %s", R_TOKEN);
                             }
                         }
-                        else
-                        {
-                            L_TOKEN = delim_buf;
-                        }
-
-                        hell_parser_t *pd = hell_parser_create(L_TOKEN);
-                        if (pd == NULL)
-                            err("Failed to allocate parser");
 
-                        if (hell_parser_delim(pd, '.', 1) == HELL_PARSER_OK)
+                        if (hell_span_split(L_TOKEN, '.', &left, &right))
                         {
-                            size_t l_size = pd->pos - 1;
-                            size_t r_size = pd->length - pd->pos;
-
-                            char *left  = calloc(1, l_size);
-                            char *right = calloc(1, r_size);
-
-                            strncpy(left, pd->input, l_size);
-                            strncpy(right, pd->input + pd->pos, r_size);
-
-                            remove_whitespaces(left);
-                            remove_whitespaces(right);
-
                             /*
                              * Checks if the color keyword is valid.
                              * Also checks if there is a color type, and defaults to hex if not.
+                             * Named colors take it even if it's empty.
                              */
-                            idx = is_color_palette_var(left);
-                            if (idx != -1 && pd->pos < pd->length)
-                            {
-                                type = parse_color_type(right);
-                                var_arg = palette_color(pal, idx, type);
-                            }
-                            else if (!strcmp(left, "foreground") || !strcmp(left, "cursor") || !strcmp(left, "border"))
-                            {
-                                type = parse_color_type(right);
-                                var_arg = palette_color(pal, PALETTE_SIZE - 1, type);
-                            }
-                            else if (!strcmp(left, "background"))
+                            enum VARIABLE_KIND kind = resolve_variable(left, PALETTE_MAX_SIZE, &idx);
+                            if ((kind == VAR_COLOR && right.len != 0) || kind == VAR_ALIAS)
                             {
                                 type = parse_color_type(right);
-                                var_arg = palette_color(pal, 0, type);
-                            }
-
-                            free(left);
-                            free(right);
-                        }
-                        /* check if an argument stands for wallpaper path */
-                        else if (!strcmp(delim_buf, "wallpaper"))
-                        {
-                            if (ARGS.IMAGE != NULL)
-                            {
-                                len = strlen(ARGS.IMAGE);
-                                var_arg = ARGS.IMAGE;
+                                slot = idx;
                             }
-                            else if (ARGS.THEME)
-                                var_arg = ARGS.THEME;
-                            else
-                                var_arg = "";
                         }
-                        /* check other keywords */
-                        else if (!strcmp(delim_buf, "foreground") || !strcmp(delim_buf, "cursor") || !strcmp(delim_buf, "border"))
-                            var_arg = palette_color(pal, PALETTE_SIZE - 1, HEX_t);
-                        else if (!strcmp(delim_buf, "background"))
-                            var_arg = palette_color(pal, 0, HEX_t);
                         else
                         {
-                            /* '.' was not found, try to find color, put hex by default on it */
-                            idx = is_color_palette_var(L_TOKEN);
-
-                            if (idx != -1)
-                                var_arg = palette_color(pal, idx, HEX_t);
+                            /* '.' was not found, put hex by default on color,
+                             * only colorN takes additional variables */
+                            enum VARIABLE_KIND kind = resolve_variable(L_TOKEN, PALETTE_MAX_SIZE, &idx);
+                            if (kind == VAR_COLOR || (kind == VAR_ALIAS && R_TOKEN == NULL))
+                                slot = idx;
+                            else if (kind == VAR_WALLPAPER && R_TOKEN == NULL)
+                                wallpaper = 1;
                         }
 
-                        if (var_arg != NULL)
+                        if (wallpaper)
                         {
-                            // process alpha if provided by R_TOKEN
-                            var_arg = process_addtional_variables(var_arg, R_TOKEN, type);
-
-                            len = strlen(var_arg);
-                            template_size += len + 1;
-                            template_buffer = realloc(template_buffer, template_size);
-                            if (template_buffer == NULL) return;
-                            strcat(template_buffer, var_arg);
+                            template_emit(prog, TEMPLATE_OP_WALLPAPER, 0, HEX_t, NULL, 0);
+                        }
+                        else if (slot != -1)
+                        {
+                            // process alpha if provided by R_TOKEN, it's only appended to color
+                            char empty[] = "";
+                            char *suffix = process_addtional_variables(empty, R_TOKEN, type);
+
+                            template_emit(prog, TEMPLATE_OP_COLOR, slot, type, suffix, strlen(suffix));
+                            if (suffix != empty)
+                                free(suffix);
                         }
 
                         /* Update last read buffer position */
                         buffrd_pos = p->pos;
 
                         skip = 0;
-                        free(delim_buf);
-                        hell_parser_destroy(pd);
-                        hell_parser_destroy(pdt);
+                        if (delim_buf != stack_buf)
+                            free(delim_buf);
                     }
                 }
             }
@@ -2230,20 +6271,53 @@ void process_template(TEMPLATE *t, PALETTE pal)
      * add rest of the content
      */
     if ((size_t)buffrd_pos < p->length)
+        template_emit_literal(prog, p->input + buffrd_pos, p->length - buffrd_pos);
+
+    return 1;
+}
+
+/*
+ * replaces variables of template t->path (or given t->content) with colors from table,
+ * template files are compiled once and kept in OUTPUT/cache/templates/
+ */
+void process_template(TEMPLATE *t, const COLOR_TABLE *colors)
+{
+    if (t == NULL)
+        return;
+
+    TEMPLATE_PROGRAM prog;
+    struct stat st;
+
+    if (t->content != NULL)
     {
-        size_t size = p->length - buffrd_pos;
+        if (!template_compile(t->content, &prog))
+        {
+            t->content = NULL;
+            return;
+        }
+    }
+    else if (!template_program_load(t->path, &prog, &st))
+    {
+        char *file_content = load_file(t->path);
+        if (file_content == NULL)
+        {
+            warn("Failed to open file: %s", t->path);
+            return;
+        }
 
-        template_size += size + 1;
-        template_buffer = realloc(template_buffer, template_size);
-        if (template_buffer == NULL) 
+        int compiled = template_compile(file_content, &prog);
+        free(file_content);
+        if (!compiled)
             return;
 
-        strncat(template_buffer, p->input + buffrd_pos, size);
+        template_program_store(t->path, &prog, &st);
     }
 
-    hell_parser_destroy(p);
+    STRBUF out;
+    template_render(&prog, colors, &out);
+    template_program_free(&prog);
 
-    t->content = template_buffer;
+    t->content = out.data;
 }
 
 /* return array of TEMPLATE structure of files in directory */
@@ -2303,38 +6377,134 @@ TEMPLATE **get_template_structure_dir(const char *dir_path, size_t *_size)
     return t_arr;
 }
 
+/* 1 if file at path holds exactly len bytes of data */
+int file_content_equals(const char *path, const char *data, size_t len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    int equal = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == len)
+    {
+        if (len == 0)
+            equal = 1;
+        else
+        {
+            void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                equal = memcmp(map, data, len) == 0;
+                munmap(map, len);
+            }
+        }
+    }
+
+    close(fd);
+    return equal;
+}
+
 /* 
- * write generated template to dir,
- * returns 1 on success
+ * write generated template to dir, file is left untouched
+ * when it already has the same content, so nothing watching
+ * it reloads for no reason. New content goes to hidden temp
+ * file in the same dir and is renamed over the old one, so
+ * readers never see it truncated or half written. Symlinked
+ * output stays a symlink: its target is replaced in target's
+ * dir, dangling one is written through in place
  */
-size_t template_write(TEMPLATE *t, char *dir)
+int template_write(TEMPLATE *t, char *dir)
 {
-    if (t == NULL || dir == NULL) return 0;
-    if (t->content == NULL) return 0;
+    if (t == NULL || dir == NULL) return TEMPLATE_WRITE_FAILED;
+    if (t->content == NULL) return TEMPLATE_WRITE_FAILED;
 
     char* path = malloc(strlen(dir) + strlen(t->name) + 1);
     if (path)
         sprintf(path, "%s%s", dir, t->name);
     else
-        return 0;
+        return TEMPLATE_WRITE_FAILED;
+
+    if (file_content_equals(path, t->content, strlen(t->content)))
+    {
+        free(path);
+        return TEMPLATE_WRITE_UNCHANGED;
+    }
+
+    size_t len = strlen(t->content);
+
+    /* rename() would replace the symlink itself with regular file */
+    struct stat lst;
+    char *target = NULL;
+    int in_place = 0;
+    if (lstat(path, &lst) == 0 && S_ISLNK(lst.st_mode))
+        in_place = (target = realpath(path, NULL)) == NULL;
 
-    FILE *f = fopen(path, "w");
+    /* temp file goes next to the file actually replaced */
+    const char *out = target ? target : path;
+    const char *slash = strrchr(out, '/');
+    size_t out_dir_len = slash ? (size_t)(slash - out) + 1 : 0;
+
+    char *tmp_path = malloc(strlen(out) + 32);
+    if (tmp_path == NULL)
+    {
+        free(target);
+        free(path);
+        return TEMPLATE_WRITE_FAILED;
+    }
+    if (in_place)
+        strcpy(tmp_path, path);
+    else
+        sprintf(tmp_path, "%.*s.%s.%d.tmp", (int)out_dir_len, out, out + out_dir_len, (int)getpid());
+
+    FILE *f = fopen(tmp_path, "w");
     if (f == NULL)
     {
-        warn("Cannot write to file: %s", path);
+        warn("Cannot write to file: %s", tmp_path);
+        free(tmp_path);
+        free(target);
         free(path);
-        return 0;
+        return TEMPLATE_WRITE_FAILED;
     }
 
-    fprintf(f, "%s", t->content);
-    
-    if (ARGS.DEBUG != 0)
-        log_c("  - wrote template to: %s\n", path);
+    /* keep permissions of file being replaced */
+    struct stat st;
+    if (!in_place && stat(out, &st) == 0)
+        fchmod(fileno(f), st.st_mode & 07777);
 
-    fclose(f);
+    int ok = fwrite(t->content, 1, len, f) == len && fflush(f) == 0;
+    if (ok && ARGS.DURABLE != 0)
+        ok = fdatasync(fileno(f)) == 0;
+
+    if (fclose(f) != 0 || !ok || (!in_place && rename(tmp_path, out) != 0))
+    {
+        warn("Cannot write to file: %s", out);
+        if (!in_place)
+            unlink(tmp_path);
+        free(tmp_path);
+        free(target);
+        free(path);
+        return TEMPLATE_WRITE_FAILED;
+    }
+
+    /* make rename itself durable */
+    if (ARGS.DURABLE != 0 && !in_place)
+    {
+        char *out_dir = out_dir_len ? strndup(out, out_dir_len) : strdup(".");
+        int dfd = out_dir ? open(out_dir, O_RDONLY | O_DIRECTORY) : -1;
+        if (dfd >= 0)
+        {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(out_dir);
+    }
+
+    free(tmp_path);
+    free(target);
     free(path);
 
-    return 1;
+    return TEMPLATE_WRITE_DONE;
 }
 
 /*
@@ -2400,16 +6570,68 @@ int hex_to_rgb(const char *hex, RGB *p)
     return 1;
 }
 
-int is_color_palette_var(char *name)
+/*
+ * resolves variable name to palette slot without allocating or copying:
+ *   colorN                     - VAR_COLOR, N if it's below colors
+ *   foreground, cursor, border - VAR_ALIAS, last base color
+ *   background                 - VAR_ALIAS, first color
+ *   wallpaper                  - VAR_WALLPAPER
+ * keywords differ in length or first letter, so it's at most one memcmp
+ */
+enum VARIABLE_KIND resolve_variable(hell_span_t name, unsigned colors, int *slot)
 {
-    for (size_t i = 0; i < PALETTE_SIZE; i++) {
-        char *col = calloc(1, 16);
-        sprintf(col, "color%lu", i);
+    const char *s = name.ptr;
 
-        if (strcmp(col, name) == 0)
-            return i;
+    if (name.len >= 6 && name.len <= 8 && s[0] == 'c' && s[1] == 'o')
+    {
+        *slot = color_var_index(s, name.len, colors);
+        return *slot != -1 ? VAR_COLOR : VAR_NONE;
     }
-    return -1;
+
+    switch (name.len) {
+    case 6:
+        if (s[0] == 'c' ? !memcmp(s, "cursor", 6) : !memcmp(s, "border", 6))
+        {
+            *slot = PALETTE_SIZE - 1;
+            return VAR_ALIAS;
+        }
+        break;
+    case 9:
+        if (!memcmp(s, "wallpaper", 9))
+            return VAR_WALLPAPER;
+        break;
+    case 10:
+        if (s[0] == 'f' ? !memcmp(s, "foreground", 10) : !memcmp(s, "background", 10))
+        {
+            *slot = s[0] == 'f' ? PALETTE_SIZE - 1 : 0;
+            return VAR_ALIAS;
+        }
+        break;
+    }
+
+    return VAR_NONE;
+}
+
+/* index of colorN variable (len bytes of name) below colors, -1 if it's not one */
+int color_var_index(const char *name, size_t len, unsigned colors)
+{
+    /* palettes have at most PALETTE_MAX_SIZE colors, so 3 digits */
+    if (len < 6 || len > 8 || strncmp(name, "color", 5) != 0)
+        return -1;
+
+    const char *num = name + 5;
+    if (num[0] == '0' && len != 6)
+        return -1;
+
+    unsigned idx = 0;
+    for (size_t i = 0; i < len - 5; i++)
+    {
+        if (num[i] < '0' || num[i] > '9')
+            return -1;
+        idx = idx * 10 + (num[i] - '0');
+    }
+
+    return idx < colors ? (int)idx : -1;
 }
 
 /* process theme, return color palette - return 0 on error */
@@ -2419,36 +6641,42 @@ int process_theme(char *t, PALETTE *pal)
         return 0;
 
     int processed_colors = 0;
-    hell_parser_t *p = hell_parser_create(t);
-
-    if (p == NULL) 
-        err("Failed to create parser");
+    hell_parser_t parser;
+    hell_parser_t *p = &parser;
+    hell_parser_init(p, t, strlen(t));
 
     while (!hell_parser_eof(p))
     {
+        /* jump to next delim */
+        const char *found = memchr(p->input + p->pos, HELLWAL_DELIM, p->length - p->pos);
+        p->pos = found ? (size_t)(found - p->input) : p->length;
+
         char ch;
         if (hell_parser_next(p, &ch) == HELL_PARSER_OK)
         {
             if (ch == HELLWAL_DELIM)
             {
                 p->pos -= 1;  
-                char *delim_buf = NULL;
+                hell_span_t var;
 
-                if (hell_parser_delim_buffer_between(p, HELLWAL_DELIM, HELLWAL_DELIM_COUNT, &delim_buf) == HELL_PARSER_OK)
+                if (hell_parser_delim_span_between(p, HELLWAL_DELIM, HELLWAL_DELIM_COUNT, &var) == HELL_PARSER_OK)
                 {
-                    hell_parser_t *pd = hell_parser_create(delim_buf);
-                    if (pd == NULL)
-                        err("Failed to allocate parser");
+                    /* variable and value are split in a copy, on the stack unless it's huge */
+                    char stack_buf[256];
+                    char *delim_buf = var.len < sizeof(stack_buf) ? stack_buf : malloc(var.len + 1);
+                    if (delim_buf == NULL)
+                        err("Failed to allocate memory for theme variable");
 
-                    if (hell_parser_delim(pd, '=', 1) == HELL_PARSER_OK) {
-                        size_t var_size = pd->pos - 1;
-                        size_t val_size = pd->length - pd->pos + 1;
+                    memcpy(delim_buf, var.ptr, var.len);
+                    delim_buf[var.len] = '\0';
 
-                        char *variable = calloc(1, var_size);
-                        char *value = calloc(1, val_size);
+                    hell_parser_t pd;
+                    hell_parser_init(&pd, delim_buf, var.len);
 
-                        strncpy(variable, pd->input, var_size);
-                        strncpy(value, pd->input + pd->pos + 1, val_size);
+                    if (hell_parser_delim(&pd, '=', 1) == HELL_PARSER_OK) {
+                        char *variable = delim_buf;
+                        char *value = delim_buf + (pd.pos < pd.length ? pd.pos + 1 : pd.length);
+                        delim_buf[pd.pos - 1] = '\0';
 
                         remove_whitespaces(variable);
                         remove_whitespaces(value);
@@ -2456,27 +6684,26 @@ int process_theme(char *t, PALETTE *pal)
                         RGB p;
                         if (hex_to_rgb(value, &p))
                         {
-                            int idx = is_color_palette_var(variable);
-                            if (idx != -1) {
-                                pal->colors[idx] = p;
+                            int idx;
+                            hell_span_t name = { variable, strlen(variable) };
+                            if (resolve_variable(name, ARGS.PALETTE_COLORS, &idx) == VAR_COLOR && (unsigned)idx < pal->size) {
+                                if (idx < PALETTE_SIZE)
+                                    pal->colors[idx] = p;
+                                else
+                                    pal->extended[idx - PALETTE_SIZE] = p;
                                 processed_colors++;
                             }
                         }
-                        else
-                        {
-                            free(variable);
-                            free(value);
-                        }
                     }
 
-                    free(delim_buf);
+                    if (delim_buf != stack_buf)
+                        free(delim_buf);
                 }
             }
         }
     }
-    hell_parser_destroy(p);
 
-    if (processed_colors == PALETTE_SIZE)
+    if ((unsigned)processed_colors >= pal->size)
         return 1;
 
     return 0;
@@ -2485,12 +6712,20 @@ int process_theme(char *t, PALETTE *pal)
 PALETTE process_themeing(char *theme)
 {
     char *t = load_theme(theme);
-    PALETTE pal;
+    PALETTE pal = { .extended = NULL, .size = PALETTE_SIZE };
 
     if (t!=NULL)
     {
         if (!process_theme(t, &pal))
             err("Not enough colors were specified in color palette: %s", theme);
+
+        /* extended colors are optional in themes, blend missing ones from base */
+        if (ARGS.PALETTE_COLORS > PALETTE_SIZE)
+        {
+            palette_alloc_extended(&pal, ARGS.PALETTE_COLORS);
+            palette_extend_from_base(&pal, 0);
+            process_theme(t, &pal);
+        }
     }
     else
         err("Theme not found: %s", theme);
@@ -2498,6 +6733,359 @@ PALETTE process_themeing(char *theme)
     return pal;
 }
 
+/* greatest distance between matching colors of two palettes */
+float palette_distance(PALETTE *a, PALETTE *b)
+{
+    float max = 0.0f;
+
+    for (unsigned i = 0; i < a->size && i < b->size; i++)
+    {
+        float d = calculate_color_distance(palette_get(a, i), palette_get(b, i));
+        if (d > max)
+            max = d;
+    }
+
+    return max;
+}
+
+/* show palette, set it to terminals, write templates and run script */
+void apply_palette(PALETTE pal)
+{
+    /* print palette colors as blocks*/
+    print_palette(pal);
+
+    /* every color in every format, shared by terminals and templates */
+    COLOR_TABLE colors;
+    color_table_init(&colors, &pal);
+
+    /* set terminal colors using ANSI escape codes */
+    set_term_colors(&colors);
+
+    /* read template files, process them and write results to --output */
+    process_templating(&colors);
+
+    /* Run script or command from --script argument */
+    run_script(ARGS.SCRIPT);
+}
+
+/* image formats stb_image can decode */
+int is_image_file(const char *name)
+{
+    static const char *exts[] = { "jpg", "jpeg", "png", "bmp", "tga", "gif", "psd", "hdr", "pic", "pnm", "ppm", "pgm" };
+
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL)
+        return 0;
+
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++)
+        if (strcasecmp(dot + 1, exts[i]) == 0)
+            return 1;
+    return 0;
+}
+
+/* appends images in path to files, descends into subdirectories with --recursive */
+void collect_images(const char *path, char ***files, size_t *count)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        warn("Cannot access directory %s", path);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char *file = calloc(1, strlen(path) + strlen(entry->d_name) + 2);
+        if (file == NULL)
+            err("Failed to allocate memory for file path");
+        sprintf(file, "%s/%s", path, entry->d_name);
+
+        unsigned char type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN || type == DT_LNK)
+            type = stat(file, &st) != 0 ? DT_UNKNOWN : (S_ISDIR(st.st_mode) ? DT_DIR : DT_REG);
+
+        if (type == DT_DIR && ARGS.RECURSIVE != 0)
+        {
+            collect_images(file, files, count);
+        }
+        else if (type == DT_REG && is_image_file(entry->d_name))
+        {
+            *files = realloc(*files, sizeof(char *) * (*count + 1));
+            if (*files == NULL)
+                err("Failed to allocate memory for file list");
+            (*files)[(*count)++] = file;
+            continue;
+        }
+        free(file);
+    }
+    closedir(dir);
+}
+
+/* lowest cpu and idle i/o priority, prewarm should not be noticed */
+void set_background_priority(void)
+{
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0 && ARGS.DEBUG != 0)
+        log_c("Failed to lower cpu priority");
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT */
+    if (syscall(SYS_ioprio_set, 1, 0, 3 << 13) != 0 && ARGS.DEBUG != 0)
+        log_c("Failed to lower i/o priority");
+#endif
+}
+
+/* waits for one prewarm child, returns 1 if it succeeded */
+static int prewarm_wait(pid_t *pids, char **names, unsigned jobs)
+{
+    int status;
+    pid_t pid = wait(&status);
+
+    for (unsigned i = 0; i < jobs; i++)
+    {
+        if (pids[i] != pid || pid <= 0)
+            continue;
+
+        pids[i] = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+            return 1;
+
+        warn("Failed to prewarm %s", names[i]);
+        return 0;
+    }
+
+    return 0;
+}
+
+/*
+ * --prewarm: fills palette cache for every image in dir, so switching
+ * to them later (e.g. --random) is a cache hit. Cached files are found
+ * by their fingerprint without decoding, the rest is computed by up to
+ * --jobs children, one per image, so a broken image fails only itself.
+ */
+void prewarm(char *dir)
+{
+    char **files = NULL;
+    size_t count = 0, cached = 0, computed = 0, failed = 0;
+
+    collect_images(dir, &files, &count);
+    set_background_priority();
+
+    unsigned jobs = ARGS.JOBS;
+    pid_t *pids = calloc(jobs, sizeof(pid_t));
+    char **names = calloc(jobs, sizeof(char *));
+    unsigned running = 0;
+    if (pids == NULL || names == NULL)
+        err("Failed to allocate memory for prewarm jobs");
+
+    for (size_t f = 0; f < count; f++)
+    {
+        PALETTE p;
+        if (check_cached_palette(files[f], &p))
+        {
+            free(p.extended);
+            cached++;
+            continue;
+        }
+
+        if (running == jobs)
+        {
+            running--;
+            if (prewarm_wait(pids, names, jobs)) computed++;
+            else failed++;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            ARGS.IMAGE = files[f];
+            p = get_color_palette(p);
+            exit(EXIT_SUCCESS);
+        }
+        else if (pid < 0)
+        {
+            warn("Failed to fork, skipping %s", files[f]);
+            failed++;
+            continue;
+        }
+
+        for (unsigned i = 0; i < jobs; i++)
+        {
+            if (pids[i] == 0)
+            {
+                pids[i] = pid;
+                names[i] = files[f];
+                break;
+            }
+        }
+        running++;
+    }
+
+    for (; running > 0; running--)
+    {
+        if (prewarm_wait(pids, names, jobs)) computed++;
+        else failed++;
+    }
+
+    log_c("Prewarmed %s: %zu images, %zu computed, %zu already cached, %zu failed",
+          dir, count, computed, cached, failed);
+
+    for (size_t f = 0; f < count; f++)
+        free(files[f]);
+    free(files);
+    free(pids);
+    free(names);
+}
+
+/* exclusive flock of OUTPUT/cache/run.lock, returns fd or -1 */
+int run_lock(int create)
+{
+    size_t len = strlen(ARGS.OUTPUT) + strlen("/cache/run.lock") + 1;
+    char *path = malloc(len);
+    if (path == NULL)
+        return -1;
+
+    if (create)
+    {
+        snprintf(path, len, "%s/cache/", ARGS.OUTPUT);
+        check_output_dir(ARGS.OUTPUT);
+        check_output_dir(path);
+    }
+    snprintf(path, len, "%s/cache/run.lock", ARGS.OUTPUT);
+
+    int fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    free(path);
+
+    if (fd >= 0 && flock(fd, LOCK_EX) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/* run that applies palette: its pid and image or theme */
+void run_token(char *buf, size_t size, pid_t pid)
+{
+    snprintf(buf, size, "%d %s", (int)pid, ARGS.IMAGE ? ARGS.IMAGE : (ARGS.THEME ? ARGS.THEME : "-"));
+}
+
+/*
+ * every run that applies palette records itself in the run lock file,
+ * so background refine of older run knows it was superseded. File is
+ * created only by --progressive runs, nothing can be superseded before
+ */
+void run_token_write(void)
+{
+    char token[PATH_MAX + 32];
+    run_token(token, sizeof(token), getpid());
+
+    int fd = run_lock(ARGS.PROGRESSIVE != 0 && PROGRESSIVE_IMG != NULL);
+    if (fd < 0)
+        return;
+
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, token, strlen(token), 0) != (ssize_t)strlen(token))
+        warn("Failed to record run in %s/cache/run.lock", ARGS.OUTPUT);
+
+    close(fd);
+}
+
+/* run lock fd if token is still the newest run (lock is kept until close), -1 otherwise */
+int run_token_current(const char *token)
+{
+    int fd = run_lock(0);
+    if (fd < 0)
+        return -1;
+
+    char current[PATH_MAX + 32];
+    ssize_t n = pread(fd, current, sizeof(current) - 1, 0);
+    current[n > 0 ? n : 0] = '\0';
+
+    if (strcmp(current, token) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * progressive mode: quick palette is already applied, compute full one
+ * in forked child, so caller does not wait for it. Full palette gets
+ * cached and is applied only if it differs from [shown] enough and no
+ * newer run applied its palette meanwhile.
+ */
+void progressive_refine(PALETTE shown)
+{
+    if (PROGRESSIVE_IMG == NULL)
+        return;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    char token[PATH_MAX + 32];
+    run_token(token, sizeof(token), getpid());
+
+    pid_t pid = fork();
+    if (pid > 0)
+        return;
+    if (pid < 0)
+        warn("Failed to fork, refining palette in foreground");
+
+    /* parent has probably returned to shell by now, pipe it writes to
+     * is not held open by the child */
+    if (pid == 0 && ARGS.DEBUG == 0)
+    {
+        ARGS.QUIET = 1;
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+        {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            close(null);
+        }
+    }
+
+    uint8_t signature[SIGNATURE_SIZE];
+    img_signature(PROGRESSIVE_IMG, signature);
+    PALETTE full = gen_palette(PROGRESSIVE_IMG, signature);
+    palette_write_cache(ARGS.IMAGE, &full, signature, quantizer_backend());
+    img_free(PROGRESSIVE_IMG);
+    PROGRESSIVE_IMG = NULL;
+
+    apply_addtional_arguments(&full);
+    palette_write_final(ARGS.IMAGE, &full);
+
+    float d = palette_distance(&shown, &full);
+    if (d > PROGRESSIVE_THRESHOLD)
+    {
+        /* newer run waits for the lock to record itself, so it applies after us */
+        int lock = run_token_current(token);
+        if (lock >= 0)
+        {
+            log_c("Refined palette differs by %.1f, applying it", d);
+            apply_palette(full);
+            close(lock);
+        }
+        else
+            log_c("Refined palette differs by %.1f, newer run applied its palette, keeping it", d);
+    }
+    else
+        log_c("Refined palette differs by %.1f, keeping quick one", d);
+
+    if (pid == 0)
+        exit(EXIT_SUCCESS);
+}
+
 /***
  * MAIN
  ***/
@@ -2507,23 +7095,51 @@ int main(int argc, char **argv)
     if (set_args(argc,argv) != 0)
         err("arguments error");
 
-    /* generate palette from image or theme */
-    PALETTE pal = get_color_palette(pal);
+    if (ARGS.CACHE_GC != 0)
+    {
+        cache_gc();
+        return 0;
+    }
 
-    /* apply theme'ing options liek --light, --color, --gray-scale 0.5 */
-    apply_addtional_arguments(&pal);
+    cache_init();
 
-    /* print palette colors as blocks*/
-    print_palette(pal);
+    if (ARGS.PREWARM != NULL)
+    {
+        prewarm(ARGS.PREWARM);
+        return 0;
+    }
 
-    /* set terminal colors using ANSI escape codes */
-    set_term_colors(pal);
+    if (ARGS.ROLLBACK != 0)
+    {
+        generation_rollback();
+        return 0;
+    }
 
-    /* read template files, process them and write results to --output */
-    process_templating(pal);
+    PALETTE pal;
 
-    /* Run script or command from --script argument */
-    run_script(ARGS.SCRIPT);
+    /* same image with same flags is just a lookup */
+    if (!check_final_palette(ARGS.IMAGE, &pal))
+    {
+        /* generate palette from image or theme */
+        pal = get_color_palette(pal);
+
+        /* apply theme'ing options liek --light, --color, --gray-scale 0.5 */
+        apply_addtional_arguments(&pal);
+
+        /* quick --progressive palette is not final */
+        if (PROGRESSIVE_IMG == NULL)
+            palette_write_final(ARGS.IMAGE, &pal);
+    }
+
+    /* background refine of previous run must not override this one */
+    if (ARGS.JSON == 0)
+        run_token_write();
+
+    /* print, set to terminals, write templates and run script */
+    apply_palette(pal);
+
+    /* in --progressive mode compute full palette in background */
+    progressive_refine(pal);
 
     return 0;
 }